@@ -0,0 +1,352 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include <ac/xec/strand.hpp>
+#include <ac/xec/post.hpp>
+
+#include <astl/move.hpp>
+
+#include <atomic>
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace ac::local {
+
+// A fixed set of threads which run inference jobs away from the session strands
+// Sessions co_await the jobs and are resumed on their strand when a job completes.
+// The queue is bounded: when it's full new jobs are rejected with an error instead of piling up latency.
+//
+// A job is bound to the coroutine which awaits it, so the job function may capture the coroutine's locals by
+// reference. This is enforced by the awaiter (Job or ProgressJob): if it's destroyed while the job is queued, the job
+// is dropped without running, and if it's destroyed while the job runs, it blocks until the job is done. In both
+// cases the destroyed coroutine is never resumed.
+// Jobs which are still queued when the pool is destroyed complete with an error.
+class ComputePool {
+public:
+    ComputePool(uint32_t numThreads, size_t maxQueue)
+        : m_maxQueue(maxQueue)
+    {
+        m_threads.reserve(numThreads);
+        for (uint32_t i = 0; i < numThreads; ++i) {
+            m_threads.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~ComputePool() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stopped = true;
+        }
+        m_cv.notify_all();
+        for (auto& t : m_threads) {
+            t.join();
+        }
+
+        // fail the jobs which never ran, so that their coroutines aren't left suspended forever
+        auto stopped = std::make_exception_ptr(std::runtime_error("whisper: compute pool stopped"));
+        for (auto& job : m_queue) {
+            job(stopped);
+        }
+    }
+
+    ComputePool(const ComputePool&) = delete;
+    ComputePool& operator=(const ComputePool&) = delete;
+
+    size_t numThreads() const noexcept { return m_threads.size(); }
+    size_t maxQueue() const noexcept { return m_maxQueue; }
+
+    // jobs rejected because the queue was full
+    uint64_t numRejected() const noexcept { return m_rejected.load(std::memory_order_relaxed); }
+
+    size_t queueSize() const {
+        std::lock_guard lock(m_mutex);
+        return m_queue.size();
+    }
+
+private:
+    // shared by the awaiter and the worker
+    template <typename R>
+    struct State {
+        explicit State(xec::strand e) : ex(astl::move(e)) {}
+
+        xec::strand ex;
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool running = false;
+        bool done = false;
+        bool detached = false; // the awaiter is gone
+        std::optional<float> progress;
+        std::optional<R> result;
+        std::exception_ptr error;
+        std::coroutine_handle<> waiter;
+
+        bool ready() const { return progress || done; }
+
+        // resume the waiter (if any) on the strand, unless the awaiter is destroyed before that
+        static void wake(std::unique_lock<std::mutex>& lock, const std::shared_ptr<State>& self) {
+            auto h = std::exchange(self->waiter, nullptr);
+            lock.unlock();
+            if (h) {
+                xec::post(self->ex, [self, h] {
+                    {
+                        std::lock_guard l(self->mutex);
+                        if (self->detached) {
+                            return;
+                        }
+                    }
+                    h.resume();
+                });
+            }
+        }
+
+        // called by the awaiter when it's destroyed
+        void detach() {
+            std::unique_lock lock(mutex);
+            detached = true;
+            waiter = nullptr;
+            // the job may use the awaiting coroutine's data until it's done
+            cv.wait(lock, [this] { return !running || done; });
+        }
+
+        R takeResult() {
+            std::lock_guard lock(mutex);
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            return astl::move(*result);
+        }
+    };
+
+    // push a job which completes state with the result of run(state)
+    template <typename R, typename Run>
+    bool schedule(const std::shared_ptr<State<R>>& state, Run run) {
+        return tryPush([state, run = astl::move(run)](std::exception_ptr stopped) mutable {
+            {
+                std::lock_guard lock(state->mutex);
+                if (state->detached) {
+                    return;
+                }
+                state->running = !stopped;
+            }
+
+            std::optional<R> result;
+            std::exception_ptr error = stopped;
+            if (!stopped) {
+                try {
+                    result.emplace(run(state));
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+            }
+
+            std::unique_lock lock(state->mutex);
+            state->result = astl::move(result);
+            state->error = error;
+            state->done = true;
+            state->cv.notify_all();
+            State<R>::wake(lock, state);
+        });
+    }
+
+    static std::exception_ptr rejectedError() {
+        return std::make_exception_ptr(std::runtime_error("whisper: too many pending requests"));
+    }
+
+public:
+    template <typename Fn>
+    class Job {
+    public:
+        using Result = std::invoke_result_t<Fn&>;
+
+        Job(ComputePool& pool, xec::strand ex, Fn fn)
+            : m_pool(pool)
+            , m_state(std::make_shared<State<Result>>(astl::move(ex)))
+            , m_fn(astl::move(fn))
+        {}
+
+        Job(Job&&) = default;
+        Job(const Job&) = delete;
+        Job& operator=(const Job&) = delete;
+
+        ~Job() {
+            if (m_state) {
+                m_state->detach();
+            }
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            // the job isn't visible to the workers yet, so no lock is needed
+            m_state->waiter = h;
+            const bool pushed = m_pool.schedule(m_state, [fn = astl::move(m_fn)](auto&) mutable {
+                return fn();
+            });
+
+            if (!pushed) {
+                m_state->waiter = nullptr;
+                m_state->error = rejectedError();
+                m_state->done = true;
+            }
+
+            // don't suspend if we couldn't schedule the job
+            return pushed;
+        }
+
+        Result await_resume() {
+            return m_state->takeResult();
+        }
+
+    private:
+        ComputePool& m_pool;
+        std::shared_ptr<State<Result>> m_state;
+        Fn m_fn;
+    };
+
+    // run fn on the pool and resume the awaiting coroutine on ex
+    // the result of fn (or the exception it throws) is returned from co_await
+    template <typename Fn>
+    Job<Fn> run(xec::strand ex, Fn fn) {
+        return Job<Fn>(*this, astl::move(ex), astl::move(fn));
+    }
+
+    using ProgressCb = std::function<void(float)>;
+
+    // a job which reports progress while it runs
+    // the awaiting coroutine receives progress values with co_await nextProgress() until it returns nullopt,
+    // after which the job is done and its result can be taken with result()
+    // progress values are coalesced: if several arrive while the coroutine is busy, only the latest is received
+    template <typename R>
+    class ProgressJob {
+    public:
+        class NextProgress {
+        public:
+            explicit NextProgress(ProgressJob& job) : m_job(job) {}
+
+            bool await_ready() const {
+                std::lock_guard lock(m_job.m_state->mutex);
+                return m_job.m_state->ready();
+            }
+
+            bool await_suspend(std::coroutine_handle<> h) {
+                std::lock_guard lock(m_job.m_state->mutex);
+                if (m_job.m_state->ready()) {
+                    return false;
+                }
+                m_job.m_state->waiter = h;
+                return true;
+            }
+
+            std::optional<float> await_resume() {
+                std::lock_guard lock(m_job.m_state->mutex);
+                return std::exchange(m_job.m_state->progress, std::nullopt);
+            }
+        private:
+            ProgressJob& m_job;
+        };
+
+        ProgressJob(ProgressJob&&) = default;
+        ProgressJob(const ProgressJob&) = delete;
+        ProgressJob& operator=(const ProgressJob&) = delete;
+
+        ~ProgressJob() {
+            if (m_state) {
+                m_state->detach();
+            }
+        }
+
+        NextProgress nextProgress() { return NextProgress(*this); }
+
+        R result() {
+            return m_state->takeResult();
+        }
+
+    private:
+        friend class ComputePool;
+
+        explicit ProgressJob(std::shared_ptr<State<R>> state) : m_state(astl::move(state)) {}
+
+        std::shared_ptr<State<R>> m_state;
+    };
+
+    // run fn(ProgressCb) on the pool, delivering progress and completion to a coroutine on ex
+    template <typename Fn>
+    auto runWithProgress(xec::strand ex, Fn fn) {
+        using R = std::invoke_result_t<Fn&, ProgressCb>;
+
+        auto state = std::make_shared<State<R>>(astl::move(ex));
+
+        const bool pushed = schedule(state, [fn = astl::move(fn)](const std::shared_ptr<State<R>>& s) mutable {
+            return fn([&](float progress) {
+                std::unique_lock lock(s->mutex);
+                s->progress = progress;
+                State<R>::wake(lock, s);
+            });
+        });
+
+        if (!pushed) {
+            state->error = rejectedError();
+            state->done = true;
+        }
+
+        return ProgressJob<R>(astl::move(state));
+    }
+
+private:
+    using QueuedJob = std::function<void(std::exception_ptr stopped)>;
+
+    bool tryPush(QueuedJob job) {
+        {
+            std::lock_guard lock(m_mutex);
+            if (m_queue.size() >= m_maxQueue) {
+                m_rejected.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            m_queue.push_back(astl::move(job));
+        }
+        m_cv.notify_one();
+        return true;
+    }
+
+    void workerLoop() {
+        while (true) {
+            QueuedJob job;
+            {
+                std::unique_lock lock(m_mutex);
+                m_cv.wait(lock, [this] { return m_stopped || !m_queue.empty(); });
+                if (m_stopped) {
+                    return;
+                }
+                job = astl::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            job(nullptr);
+        }
+    }
+
+    const size_t m_maxQueue;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<QueuedJob> m_queue;
+    bool m_stopped = false;
+    std::atomic_uint64_t m_rejected = 0;
+
+    std::vector<std::thread> m_threads;
+};
+
+} // namespace ac::local
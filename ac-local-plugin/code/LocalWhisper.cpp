@@ -4,6 +4,7 @@
 #include <ac/whisper/Instance.hpp>
 #include <ac/whisper/Init.hpp>
 #include <ac/whisper/Model.hpp>
+#include <ac/whisper/Pcm.hpp>
 
 #include <ac/local/Service.hpp>
 #include <ac/local/ServiceFactory.hpp>
@@ -21,6 +22,7 @@
 
 #include <ac/xec/coro.hpp>
 #include <ac/xec/co_spawn.hpp>
+#include <ac/xec/post.hpp>
 #include <ac/io/exception.hpp>
 
 #include <astl/move.hpp>
@@ -29,8 +31,21 @@
 #include <astl/throw_stdex.hpp>
 #include <astl/workarounds.h>
 
+#include <algorithm>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <chrono>
+#include <optional>
+#include <span>
+#include <thread>
+#include <utility>
+
 #include "aclp-whisper-version.h"
 #include "aclp-whisper-interface.hpp"
+#include "ComputePool.hpp"
+#include "ModelCache.hpp"
+#include "Metrics.hpp"
 
 namespace ac::local {
 
@@ -39,17 +54,218 @@ using namespace ac::frameio;
 
 namespace {
 
+constexpr std::string_view Audio_key = "audio_binary_mono";
+
+// binary audio is moved out of the frame before the params are parsed, so it is never deserialized into a vector
+std::optional<Dict::binary_t> Audio_takeBinary(Frame& f) {
+    if (!f.data.is_object()) {
+        return std::nullopt;
+    }
+    auto it = f.data.find(std::string(Audio_key));
+    if (it == f.data.end() || !it->is_binary()) {
+        return std::nullopt;
+    }
+    std::optional<Dict::binary_t> ret(astl::move(it->get_binary()));
+    f.data.erase(it);
+    return ret;
+}
+
+// audio of a request: a binary blob viewed in place, or the samples from the params
+// audio which is not 16 kHz mono float32 is converted once
+class AudioInput {
+public:
+    AudioInput(
+        std::optional<Dict::binary_t> blob,
+        schema::Field<std::vector<float>>& samples,
+        const std::string& sampleFormat,
+        whisper::PcmFormat format = {}
+    ) {
+        const bool native = format.sampleRate == whisper::Pcm_sampleRate && format.channels == 1;
+
+        if (!blob) {
+            if (!samples.has_value()) {
+                throw_ex{} << "whisper: missing " << Audio_key;
+            }
+            setF32(samples.value(), format, native);
+            return;
+        }
+
+        m_blob = astl::move(*blob);
+        if (sampleFormat == "f32") {
+            if (m_blob.size() % sizeof(float)) {
+                throw_ex{} << "whisper: f32 audio size is not a multiple of 4: " << m_blob.size();
+            }
+            setF32({reinterpret_cast<const float*>(m_blob.data()), m_blob.size() / sizeof(float)}, format, native);
+        }
+        else if (sampleFormat == "s16") {
+            if (m_blob.size() % sizeof(int16_t)) {
+                throw_ex{} << "whisper: s16 audio size is not a multiple of 2: " << m_blob.size();
+            }
+            m_converted = whisper::toWhisperPcm(
+                std::span(reinterpret_cast<const int16_t*>(m_blob.data()), m_blob.size() / sizeof(int16_t)),
+                format
+            );
+            m_blob = {};
+            m_pcmf32 = m_converted;
+        }
+        else {
+            throw_ex{} << "whisper: unknown audio format: " << sampleFormat;
+        }
+    }
+
+    AudioInput(const AudioInput&) = delete;
+    AudioInput& operator=(const AudioInput&) = delete;
+
+    std::span<const float> pcmf32() const noexcept { return m_pcmf32; }
+
+private:
+    void setF32(std::span<const float> pcm, whisper::PcmFormat format, bool native) {
+        if (native) {
+            m_pcmf32 = pcm;
+        }
+        else {
+            m_converted = whisper::toWhisperPcm(pcm, format);
+            m_blob = {};
+            m_pcmf32 = m_converted;
+        }
+    }
+
+    Dict::binary_t m_blob;
+    std::vector<float> m_converted;
+    std::span<const float> m_pcmf32;
+};
+
+// frames received by a session
+// A separate coroutine reads them from the endpoint, so that a session which awaits inference still receives
+// cancel and notices when the client goes away. Both coroutines run on the session strand.
+class FrameInbox {
+public:
+    explicit FrameInbox(xec::strand ex) : m_ex(astl::move(ex)) {}
+
+    void push(Frame f) {
+        m_frames.push_back(astl::move(f));
+        ++m_numPushed;
+        wake();
+    }
+
+    // the frames are numbered in order of arrival, starting from 0
+    uint64_t numPushed() const noexcept { return m_numPushed; }
+    uint64_t numTaken() const noexcept { return m_numPushed - m_frames.size(); }
+
+    // the session will get the error after the remaining frames
+    void close(std::exception_ptr error) {
+        m_error = error;
+        wake();
+    }
+
+    class Next {
+    public:
+        explicit Next(FrameInbox& inbox) : m_inbox(inbox) {}
+
+        bool await_ready() const noexcept {
+            return !m_inbox.m_frames.empty() || m_inbox.m_error;
+        }
+        void await_suspend(std::coroutine_handle<> h) noexcept {
+            m_inbox.m_waiter = h;
+        }
+        Frame await_resume() {
+            if (m_inbox.m_frames.empty()) {
+                std::rethrow_exception(m_inbox.m_error);
+            }
+            Frame f = astl::move(m_inbox.m_frames.front());
+            m_inbox.m_frames.pop_front();
+            return f;
+        }
+
+    private:
+        FrameInbox& m_inbox;
+    };
+
+    Next next() { return Next(*this); }
+
+private:
+    void wake() {
+        if (auto h = std::exchange(m_waiter, nullptr)) {
+            xec::post(m_ex, [h] { h.resume(); });
+        }
+    }
+
+    xec::strand m_ex;
+    std::deque<Frame> m_frames;
+    uint64_t m_numPushed = 0;
+    std::exception_ptr m_error;
+    std::coroutine_handle<> m_waiter;
+};
+
 struct LocalWhisper {
     Backend& m_backend;
+    ModelCache& m_models;
+    ComputePool& m_pool;
+    Metrics& m_metrics;
+    xec::strand m_ex;
+    FrameInbox m_inbox;
+
+    // instance with inference in flight, cancelled by the reader
+    whisper::Instance* m_running = nullptr;
+
+    // a cancel received while no inference was in flight cancels the ones queued before it
+    // this is the number of the last such cancel frame in the inbox plus one (0 means none)
+    uint64_t m_cancelQueuedUntil = 0;
 public:
-    LocalWhisper(Backend& backend)
+    LocalWhisper(Backend& backend, ModelCache& models, ComputePool& pool, Metrics& metrics, xec::strand ex)
         : m_backend(backend)
+        , m_models(models)
+        , m_pool(pool)
+        , m_metrics(metrics)
+        , m_ex(ex)
+        , m_inbox(astl::move(ex))
     {}
 
+    // run fn on the compute pool as inference of the instance, which the reader may cancel
+    template <typename Fn>
+    xec::coro<std::invoke_result_t<Fn&>> runInference(whisper::Instance& instance, Fn fn) {
+        // the frame which requested this inference is the last one taken from the inbox
+        instance.resetCancel();
+        if (m_inbox.numTaken() < m_cancelQueuedUntil) {
+            instance.cancel();
+        }
+        m_running = &instance;
+        try {
+            auto ret = co_await m_pool.run(m_ex, astl::move(fn));
+            m_running = nullptr;
+            co_return ret;
+        }
+        catch (...) {
+            m_running = nullptr;
+            throw;
+        }
+    }
+
     static Frame unknownOpError(const Frame& f) {
         return Frame_from(schema::Error{}, "whisper: unknown op: " + f.op);
     }
 
+    // get-metrics is available in all states
+    std::optional<Frame> tryGetMetrics(const Frame& f) {
+        if (!Frame_optTo(schema::OpParams<sc::OpGetMetrics>{}, f)) {
+            return std::nullopt;
+        }
+
+        Metrics::Snapshot snapshot;
+        snapshot.queueDepth = m_pool.queueSize();
+        snapshot.maxQueueDepth = m_pool.maxQueue();
+        snapshot.rejectedRequests = m_pool.numRejected();
+        snapshot.loadedModels = m_models.numModels();
+        snapshot.loadedModelsBytes = m_models.totalSize();
+
+        sc::OpGetMetrics::Return ret;
+        ret.prometheus = m_metrics.renderPrometheus(snapshot);
+        ret.activeSessions = uint32_t(m_metrics.activeSessions.value());
+        ret.queueDepth = uint32_t(snapshot.queueDepth);
+        ret.loadedModels = uint32_t(snapshot.loadedModels);
+        return Frame_from(sc::OpGetMetrics{}, astl::move(ret));
+    }
+
     static whisper::Instance::InitParams InstanceParams_fromSchema(sc::StateModelLoaded::OpStartInstance::Params& params) {
         whisper::Instance::InitParams ret;
         if (params.sampler == "greedy") {
@@ -60,26 +276,273 @@ public:
             throw_ex{} << "whisper: unknown sampler type: " << params.sampler.value();
             MSVC_WO_10766806();
         }
+        ret.tokenTimestamps = params.tokenTimestamps.valueOr(ret.tokenTimestamps);
+        ret.nThreads = params.threads.valueOr(ret.nThreads);
+        ret.beamSize = params.beamSize.valueOr(ret.beamSize);
+        ret.bestOf = params.bestOf.valueOr(ret.bestOf);
+        ret.audioCtx = params.audioCtx.valueOr(ret.audioCtx);
+        ret.autoAudioCtx = params.autoAudioCtx.valueOr(ret.autoAudioCtx);
+        ret.minAudioCtx = params.minAudioCtx.valueOr(ret.minAudioCtx);
+        ret.language = params.language.valueOr(ret.language);
+        ret.translate = params.translate.valueOr(ret.translate);
+        ret.noContext = params.noContext.valueOr(ret.noContext);
+        ret.singleSegment = params.singleSegment.valueOr(ret.singleSegment);
+        ret.temperature = params.temperature.valueOr(ret.temperature);
+        ret.temperatureInc = params.temperatureInc.valueOr(ret.temperatureInc);
+        ret.maxTokens = params.maxTokens.valueOr(ret.maxTokens);
+        ret.maxTextCtx = params.maxTextCtx.valueOr(ret.maxTextCtx);
+        ret.maxLen = params.maxLen.valueOr(ret.maxLen);
+        ret.melFrontEnd = params.melFrontEnd.valueOr(ret.melFrontEnd);
+        return ret;
+    }
+
+    static sc::Timings Timings_toSchema(const whisper::Timings& t) {
+        sc::Timings ret;
+        ret.melMs = t.melMs;
+        ret.encodeMs = t.encodeMs;
+        ret.decodeMs = t.decodeMs;
+        ret.totalMs = t.totalMs;
+        ret.firstSegmentMs = t.firstSegmentMs;
+        ret.runs = t.runs;
+        ret.encoderPasses = t.encoderPasses;
+        ret.audioMs = double(t.audioSamples) * 1000 / 16000;
         return ret;
     }
 
-    xec::coro<void> runInstance(IoEndpoint& io, whisper::Instance& instance) {
+    static sc::StateInstance::OpTranscribe::Return Transcript_toSchema(whisper::Transcript&& t) {
+        sc::StateInstance::OpTranscribe::Return ret;
+
+        std::vector<sc::StateInstance::OpTranscribe::Segment> segments;
+        segments.reserve(t.segments.size());
+        for (auto& s : t.segments) {
+            auto& seg = segments.emplace_back();
+            seg.text = std::string(t.segmentText(s));
+            seg.t0 = s.t0;
+            seg.t1 = s.t1;
+            seg.noSpeechProb = s.noSpeechProb;
+            seg.tokenOffset = s.tokenOffset;
+            seg.tokenCount = s.tokenCount;
+        }
+
+        std::vector<int32_t> ids;
+        std::vector<float> p, plog;
+        std::vector<int64_t> t0, t1;
+        for (auto& token : t.tokens) {
+            ids.push_back(token.id);
+            p.push_back(token.p);
+            plog.push_back(token.plog);
+            t0.push_back(token.t0);
+            t1.push_back(token.t1);
+        }
+
+        ret.segments = astl::move(segments);
+        ret.tokenIds = astl::move(ids);
+        ret.tokenP = astl::move(p);
+        ret.tokenPlog = astl::move(plog);
+        ret.tokenT0 = astl::move(t0);
+        ret.tokenT1 = astl::move(t1);
+        ret.text = astl::move(t.text);
+        ret.language = astl::move(t.language);
+        ret.timings = Timings_toSchema(t.timings);
+
+        return ret;
+    }
+
+    static whisper::Instance::StreamParams StreamParams_fromSchema(sc::StateInstance::OpTranscribeStream::Params& params) {
+        whisper::Instance::StreamParams ret;
+        ret.stepMs = params.stepMs.valueOr(ret.stepMs);
+        ret.lengthMs = params.lengthMs.valueOr(ret.lengthMs);
+        ret.keepMs = params.keepMs.valueOr(ret.keepMs);
+        return ret;
+    }
+
+    xec::coro<void> pushSegments(IoEndpoint& io, std::vector<whisper::Instance::StreamSegment> segments, std::string& text) {
+        using Segment = sc::StateInstance::OpTranscribeStream::Segment;
+        for (auto& seg : segments) {
+            if (seg.final) {
+                text += seg.text;
+                text += '\n';
+            }
+            co_await io.push(Frame_from(Segment{}, {
+                .text = astl::move(seg.text),
+                .t0 = seg.t0,
+                .t1 = seg.t1,
+                .final = seg.final,
+            }));
+        }
+    }
+
+    // answer the frames which follow a failed stream up to its end
+    // the client may have sent more audio before it got the error
+    xec::coro<void> drainStream(IoEndpoint& io) {
+        using Op = sc::StateInstance::OpTranscribeStream;
+
+        while (true) {
+            auto f = co_await m_inbox.next();
+
+            if (f.op == Op::EndStream::id) {
+                co_return;
+            }
+            else if (f.op == Op::AudioChunk::id) {
+                // nothing to transcribe it into
+            }
+            else if (Frame_optTo(schema::OpParams<sc::StateInstance::OpCancel>{}, f)) {
+                co_await io.push(Frame_from(sc::StateInstance::OpCancel{}, {}));
+            }
+            else if (auto mf = tryGetMetrics(f)) {
+                co_await io.push(*mf);
+            }
+            else {
+                co_await io.push(unknownOpError(f));
+            }
+        }
+    }
+
+    // the steps of a stream are timed individually, as the time between them is up to the client
+    template <typename Fn>
+    xec::coro<std::vector<whisper::Instance::StreamSegment>> runStreamStep(
+        whisper::Instance& instance,
+        ModelMetrics& metrics,
+        Fn fn
+    ) {
+        auto start = std::chrono::steady_clock::now();
+        auto segments = co_await runInference(instance, astl::move(fn));
+        metrics.latency.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        co_return segments;
+    }
+
+    // a stream counts as a single request
+    // a failed stream produces a single error frame and no result
+    xec::coro<void> runStream(
+        IoEndpoint& io,
+        whisper::Instance& instance,
+        sc::StateInstance::OpTranscribeStream::Params& params,
+        ModelMetrics& metrics
+    ) {
+        using Op = sc::StateInstance::OpTranscribeStream;
+
+        metrics.requests.add();
+
+        std::string text;
+        std::string error;
+        bool endReceived = false;
+
+        try {
+            instance.beginStream(StreamParams_fromSchema(params));
+            instance.setDeadline({});
+
+            while (true) {
+                auto f = co_await m_inbox.next();
+                auto blob = Audio_takeBinary(f);
+
+                if (auto chunk = Frame_optTo(Op::AudioChunk{}, f)) {
+                    AudioInput audio(astl::move(blob), chunk->audio, chunk->audioFormat.valueOr("f32"));
+                    metrics.audioBytes.add(audio.pcmf32().size() * sizeof(float));
+                    auto segments = co_await runStreamStep(instance, metrics, [&] {
+                        instance.pushAudio(audio.pcmf32());
+                        return instance.poll();
+                    });
+                    co_await pushSegments(io, astl::move(segments), text);
+                }
+                else if (Frame_optTo(Op::EndStream{}, f)) {
+                    endReceived = true;
+                    auto segments = co_await runStreamStep(instance, metrics, [&] {
+                        return instance.finish();
+                    });
+                    co_await pushSegments(io, astl::move(segments), text);
+                    co_await io.push(Frame_from(Op{}, {
+                        .text = astl::move(text)
+                    }));
+                    co_return;
+                }
+                else if (Frame_optTo(schema::OpParams<sc::StateInstance::OpCancel>{}, f)) {
+                    co_await io.push(Frame_from(sc::StateInstance::OpCancel{}, {}));
+                }
+                else if (auto mf = tryGetMetrics(f)) {
+                    co_await io.push(*mf);
+                }
+                else {
+                    co_await io.push(unknownOpError(f));
+                }
+            }
+        }
+        catch (std::runtime_error& e) {
+            error = e.what();
+        }
+
+        metrics.errors.add();
+        instance.endStream();
+        co_await io.push(Frame_from(schema::Error{}, error));
+        if (!endReceived) {
+            co_await drainStream(io);
+        }
+    }
+
+    xec::coro<void> runInstance(IoEndpoint& io, whisper::Instance& instance, ModelMetrics& metrics) {
         using Schema = sc::StateInstance;
         co_await io.push(Frame_from(schema::StateChange{}, Schema::id));
 
         while(true) {
-            auto f = co_await io.poll();
+            auto f = co_await m_inbox.next();
             Frame err;
 
             try {
-                if (auto iparams = Frame_optTo(schema::OpParams<Schema::OpTranscribe>{}, *f)) {
-                    const auto& pcmf32 = iparams->audio.value();
-
-                    co_await io.push(Frame_from(Schema::OpTranscribe{}, {
-                        .text = instance.transcribe(pcmf32)
-                    }));
+                auto blob = Audio_takeBinary(f);
+
+                if (auto iparams = Frame_optTo(schema::OpParams<Schema::OpTranscribe>{}, f)) {
+                    whisper::PcmFormat format;
+                    format.sampleRate = iparams->sampleRate.valueOr(format.sampleRate);
+                    format.channels = iparams->channels.valueOr(format.channels);
+                    AudioInput audio(astl::move(blob), iparams->audio, iparams->audioFormat.valueOr("f32"), format);
+                    auto pcmf32 = audio.pcmf32();
+
+                    std::optional<whisper::VadParams> vad;
+                    if (iparams->vad.valueOr(false)) {
+                        vad.emplace();
+                        vad->thresholdDb = iparams->vadThresholdDb.valueOr(vad->thresholdDb);
+                    }
+
+                    metrics.requests.add();
+                    metrics.audioBytes.add(pcmf32.size() * sizeof(float));
+                    const auto start = std::chrono::steady_clock::now();
+
+                    whisper::Instance::Deadline deadline;
+                    if (auto timeoutMs = iparams->timeoutMs.valueOr(0)) {
+                        deadline = start + std::chrono::milliseconds(timeoutMs);
+                    }
+                    instance.setDeadline(deadline);
+
+                    whisper::Transcript transcript;
+                    try {
+                        transcript = co_await runInference(instance, [&] {
+                            return vad
+                                ? instance.transcribeSpeech(pcmf32, *vad)
+                                : instance.transcribeDetailed(pcmf32);
+                        });
+                    }
+                    catch (...) {
+                        metrics.errors.add();
+                        throw;
+                    }
+
+                    metrics.latency.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+                    co_await io.push(Frame_from(Schema::OpTranscribe{}, Transcript_toSchema(astl::move(transcript))));
+                } else if (auto sparams = Frame_optTo(schema::OpParams<Schema::OpTranscribeStream>{}, f)) {
+                    co_await runStream(io, instance, *sparams, metrics);
+                } else if (Frame_optTo(schema::OpParams<Schema::OpCancel>{}, f)) {
+                    // the reader has cancelled the inference in flight or the ones queued before the frame
+                    co_await io.push(Frame_from(Schema::OpCancel{}, {}));
+                } else if (auto tparams = Frame_optTo(schema::OpParams<Schema::OpGetTimings>{}, f)) {
+                    auto timings = Timings_toSchema(instance.totalTimings());
+                    if (tparams->reset.valueOr(false)) {
+                        instance.resetTotalTimings();
+                    }
+                    co_await io.push(Frame_from(Schema::OpGetTimings{}, astl::move(timings)));
+                } else if (auto mf = tryGetMetrics(f)) {
+                    co_await io.push(*mf);
                 } else {
-                    err = unknownOpError(*f);
+                    err = unknownOpError(f);
                 }
             }
             catch (std::runtime_error& e) {
@@ -97,23 +560,68 @@ public:
 
         whisper::Model::Params wParams;
         wParams.gpu = params.useGpu.valueOr(true);
+        wParams.mmap = params.useMmap.valueOr(false);
+        wParams.maxIdleStates = params.maxIdleStates.valueOr(wParams.maxIdleStates);
+        wParams.weightType = params.weightType.valueOr("");
+        wParams.cacheWeights = params.cacheWeights.valueOr(false);
+        wParams.cacheDir = params.cacheDir.valueOr("");
+
+        // like all pool jobs, it may reference the locals of this coroutine, which the job keeps from being destroyed
+        // while it runs
+        auto load = m_pool.runWithProgress(m_ex, [&](ComputePool::ProgressCb progressCb) {
+            return m_models.load(modelPath, wParams, astl::move(progressCb));
+        });
+        while (auto progress = co_await load.nextProgress()) {
+            schema::sys::Progress::Type pf;
+            pf.tag = "load";
+            pf.progress = *progress;
+            co_await io.push(Frame_from(schema::sys::Progress{}, pf));
+        }
+        auto model = load.result();
 
-        whisper::Model model(modelPath.c_str(), std::move(wParams));
+        const auto modelKey = ModelCache::keyOf(modelPath, wParams);
+        auto& modelMetrics = m_metrics.model({
+            .path = modelKey.path,
+            .weightType = modelKey.weightType,
+            .gpu = modelKey.gpu,
+        });
 
         using Schema = sc::StateModelLoaded;
         co_await io.push(Frame_from(schema::StateChange{}, Schema::id));
 
         while (true) {
-            auto f = co_await io.poll();
+            auto f = co_await m_inbox.next();
             Frame err;
             try {
-                if (auto iparams = Frame_optTo(schema::OpParams<Schema::OpStartInstance>{}, *f)) {
+                if (auto iparams = Frame_optTo(schema::OpParams<Schema::OpStartInstance>{}, f)) {
                     whisper::Instance::InitParams wiparams = InstanceParams_fromSchema(*iparams);
-                    whisper::Instance instance(model, std::move(wiparams));
-                    co_await runInstance(io, instance);
+                    const bool warmup = iparams->warmup.valueOr(false);
+
+                    // allocating the state (the kv caches and compute buffers) takes a while, so it's done on the pool
+                    std::optional<double> warmupMs;
+                    auto instance = co_await m_pool.run(m_ex, [&] {
+                        auto ret = std::make_unique<whisper::Instance>(*model, astl::move(wiparams));
+                        if (warmup) {
+                            warmupMs = ret->warmup();
+                        }
+                        return ret;
+                    });
+
+                    if (warmupMs) {
+                        using Warmup = Schema::OpStartInstance::Warmup;
+                        Warmup::Type wf;
+                        wf.durationMs = *warmupMs;
+                        co_await io.push(Frame_from(Warmup{}, wf));
+                    }
+
+                    co_await runInstance(io, *instance, modelMetrics);
+                }
+                else if (auto mf = tryGetMetrics(f)) {
+                    co_await io.push(*mf);
+                    continue;
                 }
                 else {
-                    err = unknownOpError(*f);
+                    err = unknownOpError(f);
                 }
             }
             catch (std::runtime_error& e) {
@@ -130,16 +638,20 @@ public:
         co_await io.push(Frame_from(schema::StateChange{}, Schema::id));
 
         while (true) {
-            auto f = co_await io.poll();
+            auto f = co_await m_inbox.next();
 
             Frame err;
 
             try {
-                if (auto lm = Frame_optTo(schema::OpParams<Schema::OpLoadModel>{}, * f)) {
+                if (auto lm = Frame_optTo(schema::OpParams<Schema::OpLoadModel>{}, f)) {
                     co_await runModel(io, *lm);
                 }
+                else if (auto mf = tryGetMetrics(f)) {
+                    co_await io.push(*mf);
+                    continue;
+                }
                 else {
-                    err = unknownOpError(*f);
+                    err = unknownOpError(f);
                 }
             }
             catch (std::runtime_error& e) {
@@ -150,10 +662,49 @@ public:
         }
     }
 
-    xec::coro<void> run(frameio::StreamEndpoint ep, xec::strand ex) {
+    // reads the frames of the session into the inbox
+    // cancel is applied here, so that it takes effect while the session awaits inference
+    static xec::coro<void> readFrames(std::shared_ptr<LocalWhisper> self, std::shared_ptr<IoEndpoint> io) {
         try {
-            IoEndpoint io(std::move(ep), ex);
-            co_await runSession(io);
+            while (true) {
+                auto f = co_await io->poll();
+                if (Frame_optTo(schema::OpParams<sc::StateInstance::OpCancel>{}, *f)) {
+                    if (self->m_running) {
+                        self->m_running->cancel();
+                    }
+                    else {
+                        // the target may still be queued
+                        self->m_cancelQueuedUntil = self->m_inbox.numPushed() + 1;
+                    }
+                }
+                self->m_inbox.push(astl::move(*f));
+            }
+        }
+        catch (...) {
+            // the client is gone, so stop the inference instead of finishing it for no one
+            if (self->m_running) {
+                self->m_running->cancel();
+            }
+            self->m_inbox.close(std::current_exception());
+        }
+    }
+
+    // the session keeps its LocalWhisper alive until it's done
+    // the endpoint is shared with the reader, which may outlive the session or vice versa
+    static xec::coro<void> run(std::shared_ptr<LocalWhisper> self, frameio::StreamEndpoint ep) {
+        struct ActiveSession {
+            Metrics& metrics;
+            explicit ActiveSession(Metrics& m) : metrics(m) {
+                metrics.sessions.add();
+                metrics.activeSessions.add(1);
+            }
+            ~ActiveSession() { metrics.activeSessions.add(-1); }
+        } activeSession(self->m_metrics);
+
+        try {
+            auto io = std::make_shared<IoEndpoint>(std::move(ep), self->m_ex);
+            co_spawn(self->m_ex, readFrames(self, io));
+            co_await self->runSession(*io);
         }
         catch (io::stream_closed_error&) {
             co_return;
@@ -167,18 +718,29 @@ ServiceInfo g_serviceInfo = {
 };
 
 struct WhisperService final : public Service {
-    WhisperService(BackendWorkerStrand& ws) : m_workerStrand(ws) {}
+    WhisperService(BackendWorkerStrand& ws)
+        : m_workerStrand(ws)
+        , m_pool(numComputeThreads(), numComputeThreads() * 4)
+    {}
+
+    // whisper.cpp runs each inference with up to 4 threads by default
+    // split the cores so concurrent inferences don't oversubscribe them
+    static uint32_t numComputeThreads() {
+        return std::max(1u, std::thread::hardware_concurrency() / 4);
+    }
 
     BackendWorkerStrand& m_workerStrand;
-    std::shared_ptr<LocalWhisper> whisper;
+    ComputePool m_pool;
+    Metrics m_metrics;
 
     virtual const ServiceInfo& info() const noexcept override {
         return g_serviceInfo;
     }
 
     virtual void createSession(frameio::StreamEndpoint ep, Dict) override {
-        whisper = std::make_shared<LocalWhisper>(m_workerStrand.backend);
-        co_spawn(m_workerStrand.executor(), whisper->run(std::move(ep), m_workerStrand.executor()));
+        auto ex = m_workerStrand.executor();
+        auto whisper = std::make_shared<LocalWhisper>(m_workerStrand.backend, ModelCache::instance(), m_pool, m_metrics, ex);
+        co_spawn(ex, LocalWhisper::run(astl::move(whisper), std::move(ep)));
     }
 };
 
@@ -0,0 +1,197 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <compare>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace ac::local {
+
+// Lock-free metric primitives and a registry which renders them in the Prometheus text format
+// Updates on the hot path are relaxed atomic operations. Only the creation of per-model metrics and scraping lock.
+
+class Counter {
+public:
+    void add(uint64_t n = 1) noexcept { m_value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const noexcept { return m_value.load(std::memory_order_relaxed); }
+private:
+    std::atomic_uint64_t m_value = 0;
+};
+
+class Gauge {
+public:
+    void add(int64_t n) noexcept { m_value.fetch_add(n, std::memory_order_relaxed); }
+    int64_t value() const noexcept { return m_value.load(std::memory_order_relaxed); }
+private:
+    std::atomic_int64_t m_value = 0;
+};
+
+// latency histogram in seconds with fixed buckets
+class Histogram {
+public:
+    static constexpr std::array<double, 11> bounds = {0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120};
+
+    void observe(double seconds) noexcept {
+        size_t i = 0;
+        while (i < bounds.size() && seconds > bounds[i]) {
+            ++i;
+        }
+        m_buckets[i].fetch_add(1, std::memory_order_relaxed);
+        m_sumUs.fetch_add(uint64_t(seconds * 1e6), std::memory_order_relaxed);
+    }
+
+    // appends the series of the histogram with the given name and labels (without braces)
+    void render(std::string& out, const std::string& name, const std::string& labels) const;
+
+private:
+    // shortest representation which round-trips, so that bounds are rendered like 0.05 and not 0.050000
+    static void appendDouble(std::string& out, double value) {
+        char buf[32];
+        auto r = std::to_chars(buf, buf + sizeof(buf), value);
+        out.append(buf, r.ptr);
+    }
+
+    std::array<std::atomic_uint64_t, bounds.size() + 1> m_buckets = {}; // the last one is +Inf
+    std::atomic_uint64_t m_sumUs = 0;
+};
+
+struct ModelMetrics {
+    Counter requests;      // transcription requests and streams
+    Counter errors;        // failed requests and streams
+    Counter audioBytes;    // bytes of audio (as f32 samples) received for transcription
+    Histogram latency;     // duration of transcriptions and of stream steps
+};
+
+// labels of the per-model series
+// the same model file loaded with different weight types (or on a different device) is a different model
+struct ModelLabels {
+    std::string path;
+    std::string weightType;
+    bool gpu = false;
+
+    auto operator<=>(const ModelLabels&) const = default;
+};
+
+class Metrics {
+public:
+    Gauge activeSessions;
+    Counter sessions;
+
+    // returned reference is valid for the lifetime of the registry
+    ModelMetrics& model(const ModelLabels& labels) {
+        std::lock_guard lock(m_mutex);
+        auto& p = m_models[labels];
+        if (!p) {
+            p = std::make_unique<ModelMetrics>();
+        }
+        return *p;
+    }
+
+    // gauges which are sampled at scrape time
+    struct Snapshot {
+        uint64_t queueDepth = 0;
+        uint64_t maxQueueDepth = 0;
+        uint64_t rejectedRequests = 0;
+        uint64_t loadedModels = 0;
+        uint64_t loadedModelsBytes = 0;
+    };
+
+    std::string renderPrometheus(const Snapshot& snapshot) const {
+        std::string out;
+
+        auto line = [&](const char* name, const char* type, const char* help, auto value) {
+            out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+            out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+            out += name; out += ' '; out += std::to_string(value); out += '\n';
+        };
+
+        line("whisper_sessions_active", "gauge", "Active sessions", activeSessions.value());
+        line("whisper_sessions_total", "counter", "Created sessions", sessions.value());
+        line("whisper_queue_depth", "gauge", "Pending inference jobs", snapshot.queueDepth);
+        line("whisper_queue_capacity", "gauge", "Max pending inference jobs", snapshot.maxQueueDepth);
+        line("whisper_rejected_requests_total", "counter", "Requests rejected because the queue was full", snapshot.rejectedRequests);
+        line("whisper_models_loaded", "gauge", "Models in the model cache", snapshot.loadedModels);
+        line("whisper_models_loaded_bytes", "gauge", "Size of the models in the model cache", snapshot.loadedModelsBytes);
+
+        std::lock_guard lock(m_mutex);
+
+        auto modelSeries = [&](const char* name, const char* type, const char* help, auto get) {
+            out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+            out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+            for (auto& [model, m] : m_models) {
+                out += name; out += '{'; out += renderLabels(model); out += "} "; out += std::to_string(get(*m)); out += '\n';
+            }
+        };
+
+        modelSeries("whisper_requests_total", "counter", "Transcription requests", [](const ModelMetrics& m) { return m.requests.value(); });
+        modelSeries("whisper_request_errors_total", "counter", "Failed transcription requests", [](const ModelMetrics& m) { return m.errors.value(); });
+        modelSeries("whisper_audio_bytes_total", "counter", "Audio received for transcription", [](const ModelMetrics& m) { return m.audioBytes.value(); });
+
+        out += "# HELP whisper_request_duration_seconds Duration of transcriptions\n";
+        out += "# TYPE whisper_request_duration_seconds histogram\n";
+        for (auto& [model, m] : m_models) {
+            m->latency.render(out, "whisper_request_duration_seconds", renderLabels(model));
+        }
+
+        return out;
+    }
+
+private:
+    static std::string renderLabels(const ModelLabels& labels) {
+        std::string ret = "model=\"";
+        ret += escapeLabel(labels.path);
+        ret += "\",weight_type=\"";
+        ret += escapeLabel(labels.weightType);
+        ret += "\",gpu=\"";
+        ret += labels.gpu ? "true" : "false";
+        ret += '"';
+        return ret;
+    }
+
+    static std::string escapeLabel(const std::string& value) {
+        std::string ret;
+        ret.reserve(value.size());
+        for (char c : value) {
+            if (c == '\n') {
+                ret += "\\n";
+            }
+            else {
+                if (c == '\\' || c == '"') {
+                    ret += '\\';
+                }
+                ret += c;
+            }
+        }
+        return ret;
+    }
+
+    mutable std::mutex m_mutex;
+    std::map<ModelLabels, std::unique_ptr<ModelMetrics>> m_models;
+};
+
+inline void Histogram::render(std::string& out, const std::string& name, const std::string& labels) const {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < m_buckets.size(); ++i) {
+        cumulative += m_buckets[i].load(std::memory_order_relaxed);
+        out += name; out += "_bucket{"; out += labels; out += ",le=\"";
+        if (i < bounds.size()) {
+            appendDouble(out, bounds[i]);
+        }
+        else {
+            out += "+Inf";
+        }
+        out += "\"} "; out += std::to_string(cumulative); out += '\n';
+    }
+    out += name; out += "_sum{"; out += labels; out += "} ";
+    appendDouble(out, double(m_sumUs.load(std::memory_order_relaxed)) / 1e6); out += '\n';
+    out += name; out += "_count{"; out += labels; out += "} "; out += std::to_string(cumulative); out += '\n';
+}
+
+} // namespace ac::local
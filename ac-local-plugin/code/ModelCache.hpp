@@ -0,0 +1,229 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include <ac/whisper/Model.hpp>
+
+#include <astl/move.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <tuple>
+
+namespace ac::local {
+
+// Process-wide cache of loaded models
+// Models are keyed by their canonical path and the params which affect the weights. Loading a model which is in the
+// cache returns a new reference to it, so all sessions share a single copy of the weights.
+// When the last reference to a model is released it stays in the cache as idle. Idle models are evicted in LRU order
+// when the total size of the cached models exceeds the memory budget.
+class ModelCache {
+public:
+    explicit ModelCache(uint64_t memoryBudget)
+        : m_memoryBudget(memoryBudget)
+    {}
+
+    ModelCache(const ModelCache&) = delete;
+    ModelCache& operator=(const ModelCache&) = delete;
+
+    // the budget can be set with the AC_WHISPER_MODEL_CACHE_MB env var (default 1 GB)
+    static ModelCache& instance() {
+        static ModelCache cache(budgetFromEnv());
+        return cache;
+    }
+
+    // the canonical path and only the params which affect the loaded weights
+    // how the model is read and the size of its state pool don't, so a cached model is shared regardless of them
+    // and has those of its first load
+    // per-model state outside of the cache (like the metrics) uses the same key
+    struct Key {
+        std::string path;
+        bool gpu;
+        std::string weightType;
+
+        Key(std::string p, const whisper::Model::Params& params)
+            : path(astl::move(p))
+            , gpu(params.gpu)
+            , weightType(params.weightType)
+        {
+            std::transform(weightType.begin(), weightType.end(), weightType.begin(), [](char c) {
+                return char(std::tolower(uint8_t(c)));
+            });
+        }
+
+        bool operator<(const Key& other) const {
+            return std::tie(path, gpu, weightType) < std::tie(other.path, other.gpu, other.weightType);
+        }
+    };
+
+    static Key keyOf(const std::string& binPath, const whisper::Model::Params& params) {
+        return Key{canonicalPath(binPath), params};
+    }
+
+    // progressCb is only called if the model is loaded by this call
+    // the model is loaded without holding the lock of the cache. concurrent calls for the same model wait for the
+    // load in flight instead of starting another
+    std::shared_ptr<whisper::Model> load(
+        const std::string& binPath,
+        const whisper::Model::Params& params,
+        whisper::Model::ProgressCb progressCb = {}
+    ) {
+        const Key key = keyOf(binPath, params);
+
+        std::unique_lock lock(m_mutex);
+
+        while (true) {
+            auto it = m_entries.find(key);
+            if (it == m_entries.end()) {
+                break;
+            }
+            if (it->second.model) {
+                return lease(it);
+            }
+
+            auto loading = it->second.loading;
+            lock.unlock();
+            loading.get(); // rethrows the error of the load
+            lock.lock();
+            // the model may have been evicted in the meantime, so look again
+        }
+
+        std::promise<void> loaded;
+        auto it = m_entries.try_emplace(key).first;
+        it->second.loading = loaded.get_future().share();
+        lock.unlock();
+
+        std::shared_ptr<whisper::Model> model;
+        try {
+            model = std::make_shared<whisper::Model>(binPath.c_str(), params, astl::move(progressCb));
+        }
+        catch (...) {
+            lock.lock();
+            m_entries.erase(it);
+            lock.unlock();
+            loaded.set_exception(std::current_exception());
+            throw;
+        }
+
+        lock.lock();
+        // entries which are loading are never evicted, so it is still valid
+        auto& entry = it->second;
+        entry.size = model->dataSize();
+        entry.model = astl::move(model);
+        m_totalSize += entry.size;
+        loaded.set_value();
+
+        return lease(it);
+    }
+
+    uint64_t memoryBudget() const {
+        std::lock_guard lock(m_mutex);
+        return m_memoryBudget;
+    }
+
+    void setMemoryBudget(uint64_t budget) {
+        std::lock_guard lock(m_mutex);
+        m_memoryBudget = budget;
+        evictIdle();
+    }
+
+    uint64_t totalSize() const {
+        std::lock_guard lock(m_mutex);
+        return m_totalSize;
+    }
+
+    // loaded models (excluding those which are still loading)
+    size_t numModels() const {
+        std::lock_guard lock(m_mutex);
+        return size_t(std::count_if(m_entries.begin(), m_entries.end(), [](auto& e) { return !!e.second.model; }));
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<whisper::Model> model; // null while loading
+        std::shared_future<void> loading;
+        std::weak_ptr<whisper::Model> lease;
+        uint64_t size = 0;
+        uint64_t lastUsed = 0;
+    };
+
+    static std::string canonicalPath(const std::string& path) {
+        std::error_code ec;
+        auto ret = std::filesystem::weakly_canonical(path, ec);
+        return ec ? path : ret.string();
+    }
+
+    static uint64_t budgetFromEnv() {
+        uint64_t mb = 1024;
+        if (auto env = std::getenv("AC_WHISPER_MODEL_CACHE_MB")) {
+            mb = std::strtoull(env, nullptr, 10);
+        }
+        return mb * 1024 * 1024;
+    }
+
+    // call with the mutex locked
+    std::shared_ptr<whisper::Model> lease(std::map<Key, Entry>::iterator it) {
+        auto& entry = it->second;
+        auto ret = entry.lease.lock();
+        if (!ret) {
+            // leases share the ownership of the cache entry, but notify us when the last one is released
+            ret = std::shared_ptr<whisper::Model>(entry.model.get(), [this, key = it->first](whisper::Model*) {
+                release(key);
+            });
+            entry.lease = ret;
+        }
+
+        entry.lastUsed = ++m_tick;
+        evictIdle();
+
+        return ret;
+    }
+
+    void release(const Key& key) {
+        std::lock_guard lock(m_mutex);
+        auto it = m_entries.find(key);
+        if (it == m_entries.end()) {
+            return;
+        }
+        it->second.lastUsed = ++m_tick;
+        evictIdle();
+    }
+
+    // call with the mutex locked
+    void evictIdle() {
+        while (m_totalSize > m_memoryBudget) {
+            auto lru = m_entries.end();
+            for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+                if (!it->second.model || !it->second.lease.expired()) {
+                    continue; // loading or in use
+                }
+                if (lru == m_entries.end() || it->second.lastUsed < lru->second.lastUsed) {
+                    lru = it;
+                }
+            }
+            if (lru == m_entries.end()) {
+                // everything is in use
+                return;
+            }
+            m_totalSize -= lru->second.size;
+            m_entries.erase(lru);
+        }
+    }
+
+    mutable std::mutex m_mutex;
+    std::map<Key, Entry> m_entries;
+    uint64_t m_memoryBudget;
+    uint64_t m_totalSize = 0;
+    uint64_t m_tick = 0;
+};
+
+} // namespace ac::local
@@ -7,6 +7,7 @@
 #include <ac/schema/StateChange.hpp>
 #include <ac/Dict.hpp>
 #include <vector>
+#include <cstdint>
 #include <string>
 #include <tuple>
 
@@ -14,6 +15,56 @@ namespace ac::schema {
 
 inline namespace whisper {
 
+struct Timings {
+    Field<double> melMs;
+    Field<double> encodeMs;
+    Field<double> decodeMs;
+    Field<double> totalMs;
+    Field<double> firstSegmentMs;
+    Field<uint32_t> runs;
+    Field<uint32_t> encoderPasses;
+    Field<double> audioMs;
+
+    template <typename Visitor>
+    void visitFields(Visitor& v) {
+        v(melMs, "mel_ms", "Time spent computing the log-mel spectrogram");
+        v(encodeMs, "encode_ms", "Time spent in the encoder (including prompt processing)");
+        v(decodeMs, "decode_ms", "Time spent decoding tokens");
+        v(totalMs, "total_ms", "Total time");
+        v(firstSegmentMs, "first_segment_ms", "Time to the first segment (-1 if none)");
+        v(runs, "runs", "Number of inference runs");
+        v(encoderPasses, "encoder_passes", "Number of encoded audio windows");
+        v(audioMs, "audio_ms", "Length of the processed audio");
+    }
+};
+
+struct OpGetMetrics {
+    static inline constexpr std::string_view id = "get-metrics";
+    static inline constexpr std::string_view desc = "Get the metrics of the service. Available in all states";
+
+    struct Params {
+        template <typename Visitor>
+        void visitFields(Visitor&) {}
+    };
+
+    struct Return {
+        Field<std::string> prometheus;
+        Field<uint32_t> activeSessions;
+        Field<uint32_t> queueDepth;
+        Field<uint32_t> loadedModels;
+
+        template <typename Visitor>
+        void visitFields(Visitor& v) {
+            v(prometheus, "prometheus", "All metrics in the Prometheus text exposition format");
+            v(activeSessions, "active_sessions", "Number of active sessions");
+            v(queueDepth, "queue_depth", "Number of pending inference jobs");
+            v(loadedModels, "loaded_models", "Number of models in the model cache");
+        }
+    };
+
+    using Type = Return;
+};
+
 struct StateWhisper {
     static constexpr auto id = "whisper.cpp";
     static constexpr auto desc = "Initial state";
@@ -25,11 +76,21 @@ struct StateWhisper {
         struct Params{
             Field<std::string> binPath = std::nullopt;
             Field<bool> useGpu = Default(true);
+            Field<bool> useMmap = Default(false);
+            Field<uint32_t> maxIdleStates = Default(2);
+            Field<std::string> weightType = std::nullopt;
+            Field<bool> cacheWeights = Default(false);
+            Field<std::string> cacheDir = std::nullopt;
 
             template <typename Visitor>
             void visitFields(Visitor& v) {
                 v(binPath, "binPath", "Path to the file with model data.");
                 v(useGpu, "useGpu", "Whether to use GPU for inference");
+                v(useMmap, "useMmap", "Whether to read the model file through a memory mapping");
+                v(maxIdleStates, "maxIdleStates", "Inference states of ended instances to keep for new ones");
+                v(weightType, "weightType", "Convert the f32 or f16 weights to this type on load (f16, q8_0, q5_1, q4_k, ...)");
+                v(cacheWeights, "cacheWeights", "Keep the converted model on disk and load it from there the next time");
+                v(cacheDir, "cacheDir", "Directory for converted models (default: the directory of the source file)");
             }
         };
 
@@ -39,7 +100,7 @@ struct StateWhisper {
         using Outs = std::tuple<sys::Progress>;
     };
 
-    using Ops = std::tuple<OpLoadModel>;
+    using Ops = std::tuple<OpLoadModel, OpGetMetrics>;
 };
 
 struct StateModelLoaded {
@@ -52,17 +113,70 @@ struct StateModelLoaded {
 
         struct Params {
             Field<std::string> sampler = Default("greedy");
+            Field<bool> tokenTimestamps = Default(false);
+            Field<uint32_t> threads = Default(0);
+            Field<uint32_t> beamSize = Default(0);
+            Field<uint32_t> bestOf = Default(0);
+            Field<uint32_t> audioCtx = Default(0);
+            Field<bool> autoAudioCtx = Default(false);
+            Field<uint32_t> minAudioCtx = Default(256);
+            Field<std::string> language = Default("en");
+            Field<bool> translate = Default(false);
+            Field<bool> noContext = Default(true);
+            Field<bool> singleSegment = Default(false);
+            Field<float> temperature = Default(0.f);
+            Field<float> temperatureInc = Default(0.2f);
+            Field<uint32_t> maxTokens = Default(0);
+            Field<uint32_t> maxTextCtx = Default(0);
+            Field<uint32_t> maxLen = Default(0);
+            Field<bool> melFrontEnd = Default(true);
+            Field<bool> warmup = Default(false);
 
             template <typename Visitor>
             void visitFields(Visitor& v) {
                 v(sampler, "sampler_type", "Type of the sampler to use. Options[]: greedy, beam_search");
+                v(tokenTimestamps, "token_timestamps", "Compute timestamps of individual tokens");
+                v(threads, "threads", "Number of threads for inference (0 - default)");
+                v(beamSize, "beam_size", "Number of beams for beam_search (0 - default)");
+                v(bestOf, "best_of", "Number of candidates for greedy sampling at non-zero temperature (0 - default)");
+                v(audioCtx, "audio_ctx", "Size of the encoder audio context (0 - full). Smaller is faster for short audio");
+                v(autoAudioCtx, "auto_audio_ctx", "Size the audio context to the length of short inputs (when audio_ctx is 0)");
+                v(minAudioCtx, "min_audio_ctx", "Min size of the automatic audio context");
+                v(language, "language", "Spoken language (auto - detect)");
+                v(translate, "translate", "Translate to english");
+                v(noContext, "no_context", "Don't use the text of the previous transcription as a prompt (false - carry it over between calls)");
+                v(singleSegment, "single_segment", "Force a single segment output");
+                v(temperature, "temperature", "Sampling temperature");
+                v(temperatureInc, "temperature_inc", "Temperature increase on decoding failure (0 - no fallback)");
+                v(maxTokens, "max_tokens", "Max tokens per segment (0 - no limit)");
+                v(maxTextCtx, "max_text_ctx", "Max tokens of past text to use as a prompt (0 - default)");
+                v(maxLen, "max_len", "Max characters per segment (0 - no limit)");
+                v(melFrontEnd, "mel_front_end", "Compute the spectrogram with the plugin's front end, which skips the padding and reuses frames when streaming");
+                v(warmup, "warmup", "Run the model on silence before the instance starts, so the first transcription has steady-state latency");
             }
         };
 
+        struct Warmup {
+            static inline constexpr std::string_view id = "warmup";
+            static inline constexpr std::string_view desc = "Sent before the state change when the instance was warmed up";
+
+            struct Type {
+                Field<double> durationMs;
+
+                template <typename Visitor>
+                void visitFields(Visitor& v) {
+                    v(durationMs, "duration_ms", "Duration of the warmup");
+                }
+            };
+        };
+
         using Return = StateChange;
+
+        using Ins = std::tuple<>;
+        using Outs = std::tuple<Warmup>;
     };
 
-    using Ops = std::tuple<OpStartInstance>;
+    using Ops = std::tuple<OpStartInstance, OpGetMetrics>;
 };
 
 struct StateInstance {
@@ -74,27 +188,188 @@ struct StateInstance {
         static inline constexpr std::string_view desc = "Run the whisper.cpp inference and produce some output.";
 
         struct Params {
-            Field<std::vector<float>> audio;
+            Field<std::vector<float>> audio = std::nullopt;
+            Field<std::string> audioFormat = Default("f32");
+            Field<uint32_t> sampleRate = Default(16000);
+            Field<uint32_t> channels = Default(1);
+            Field<bool> vad = Default(false);
+            Field<float> vadThresholdDb = Default(12.f);
+            Field<uint32_t> timeoutMs = Default(0);
 
             template <typename Visitor>
             void visitFields(Visitor& v) {
-                v(audio, "audio_binary_mono", "Audio data to transcribe");
+                v(audio, "audio_binary_mono", "Audio data to transcribe: a binary blob of samples in audio_format (used in place without copying) or an array of float samples");
+                v(audioFormat, "audio_format", "Format of binary audio samples: f32 or s16 (16-bit PCM) in native byte order");
+                v(sampleRate, "sample_rate", "Sample rate of the audio. Audio is resampled to 16 kHz if needed");
+                v(channels, "channels", "Number of interleaved channels of the audio. Audio is downmixed to mono if needed");
+                v(vad, "vad", "Detect speech and only transcribe the speech regions of the audio");
+                v(vadThresholdDb, "vad_threshold_db", "Min energy above the noise floor (in dB) for audio to be considered speech");
+                v(timeoutMs, "timeout_ms", "Abort the transcription if it doesn't complete in this time, including time waiting in the queue (0 - no limit)");
+            }
+        };
+
+        struct Segment {
+            Field<std::string> text;
+            Field<int64_t> t0;
+            Field<int64_t> t1;
+            Field<float> noSpeechProb;
+            Field<uint32_t> tokenOffset;
+            Field<uint32_t> tokenCount;
+
+            template <typename Visitor>
+            void visitFields(Visitor& v) {
+                v(text, "text", "Text of the segment");
+                v(t0, "t0", "Start of the segment in ms");
+                v(t1, "t1", "End of the segment in ms");
+                v(noSpeechProb, "no_speech_prob", "Probability that the segment contains no speech");
+                v(tokenOffset, "token_offset", "Index of the first token of the segment in the token arrays");
+                v(tokenCount, "token_count", "Number of tokens in the segment");
             }
         };
 
         struct Return {
             Field<std::string> text;
+            Field<std::string> language;
+            Field<std::vector<Segment>> segments;
+            Field<std::vector<int32_t>> tokenIds;
+            Field<std::vector<float>> tokenP;
+            Field<std::vector<float>> tokenPlog;
+            Field<std::vector<int64_t>> tokenT0;
+            Field<std::vector<int64_t>> tokenT1;
+            Field<Timings> timings;
 
             template <typename Visitor>
             void visitFields(Visitor& v) {
                 v(text, "text", "Transcription of audio");
+                v(language, "language", "Detected language");
+                v(segments, "segments", "Transcribed segments");
+                v(tokenIds, "token_ids", "Text tokens of all segments");
+                v(tokenP, "token_p", "Probabilities of the tokens");
+                v(tokenPlog, "token_plog", "Log probabilities of the tokens");
+                v(tokenT0, "token_t0", "Start of the tokens in ms (-1 without token timestamps)");
+                v(tokenT1, "token_t1", "End of the tokens in ms (-1 without token timestamps)");
+                v(timings, "timings", "Where the time of the transcription was spent");
+            }
+        };
+
+        using Type = Return;
+    };
+
+    struct OpTranscribeStream {
+        static inline constexpr std::string_view id = "transcribe-stream";
+        static inline constexpr std::string_view desc = "Transcribe audio incrementally as it arrives. "
+            "Feed audio with stream-audio frames and end the stream with stream-end.";
+
+        struct Params {
+            Field<uint32_t> stepMs = Default(500);
+            Field<uint32_t> lengthMs = Default(10000);
+            Field<uint32_t> keepMs = Default(200);
+
+            template <typename Visitor>
+            void visitFields(Visitor& v) {
+                v(stepMs, "step_ms", "Minimum amount of new audio (in ms) which triggers inference");
+                v(lengthMs, "length_ms", "Maximum length of the inference window (in ms)");
+                v(keepMs, "keep_ms", "Audio (in ms) from the finalized part to keep as context for the next window");
+            }
+        };
+
+        struct Return {
+            Field<std::string> text;
+
+            template <typename Visitor>
+            void visitFields(Visitor& v) {
+                v(text, "text", "Full transcription of the stream");
             }
         };
 
         using Type = Return;
+
+        struct AudioChunk {
+            static inline constexpr std::string_view id = "stream-audio";
+            static inline constexpr std::string_view desc = "Chunk of audio to append to the stream";
+
+            struct Type {
+                Field<std::vector<float>> audio = std::nullopt;
+                Field<std::string> audioFormat = Default("f32");
+
+                template <typename Visitor>
+                void visitFields(Visitor& v) {
+                    v(audio, "audio_binary_mono", "Audio data to append (same as in transcribe)");
+                    v(audioFormat, "audio_format", "Format of binary audio samples: f32 or s16. Stream audio is 16 kHz mono");
+                }
+            };
+        };
+
+        struct EndStream {
+            static inline constexpr std::string_view id = "stream-end";
+            static inline constexpr std::string_view desc = "End of the stream. Remaining audio is transcribed and finalized";
+
+            struct Type {
+                template <typename Visitor>
+                void visitFields(Visitor&) {}
+            };
+        };
+
+        struct Segment {
+            static inline constexpr std::string_view id = "stream-segment";
+            static inline constexpr std::string_view desc = "Transcribed segment";
+
+            struct Type {
+                Field<std::string> text;
+                Field<int64_t> t0;
+                Field<int64_t> t1;
+                Field<bool> final;
+
+                template <typename Visitor>
+                void visitFields(Visitor& v) {
+                    v(text, "text", "Text of the segment");
+                    v(t0, "t0", "Start of the segment in ms from the beginning of the stream");
+                    v(t1, "t1", "End of the segment in ms from the beginning of the stream");
+                    v(final, "final", "Whether the segment is final. Partial segments are replaced by the next batch");
+                }
+            };
+        };
+
+        using Ins = std::tuple<AudioChunk, EndStream>;
+        using Outs = std::tuple<Segment>;
+    };
+
+    struct OpGetTimings {
+        static inline constexpr std::string_view id = "get-timings";
+        static inline constexpr std::string_view desc = "Get the cumulative timings of the instance";
+
+        struct Params {
+            Field<bool> reset = Default(false);
+
+            template <typename Visitor>
+            void visitFields(Visitor& v) {
+                v(reset, "reset", "Reset the timings after getting them");
+            }
+        };
+
+        using Return = Timings;
+        using Type = Return;
+    };
+
+    struct OpCancel {
+        static inline constexpr std::string_view id = "cancel";
+        static inline constexpr std::string_view desc = "Cancel the running transcription (or stream step), which fails with an error. "
+            "The response to cancel comes after the one of the cancelled op";
+
+        struct Params {
+            template <typename Visitor>
+            void visitFields(Visitor&) {}
+        };
+
+        struct Return {
+            template <typename Visitor>
+            void visitFields(Visitor&) {}
+        };
+
+        using Type = Return;
     };
 
-    using Ops = std::tuple<OpTranscribe>;
+    using Ops = std::tuple<OpTranscribe, OpTranscribeStream, OpGetTimings, OpCancel, OpGetMetrics>;
     using Ins = std::tuple<>;
     using Outs = std::tuple<>;
 };
@@ -0,0 +1,64 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+
+// latency of short clips with the full and with the automatic audio context
+
+#include <ac/whisper/Init.hpp>
+#include <ac/whisper/Model.hpp>
+#include <ac/whisper/Instance.hpp>
+
+#include <ac-audio.hpp>
+
+#include "ac-test-data-whisper-dir.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <span>
+#include <vector>
+
+namespace {
+double medianMs(ac::whisper::Instance& instance, std::span<const float> clip, int runs) {
+    std::vector<double> times;
+    for (int i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        instance.transcribe(clip);
+        std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - start;
+        times.push_back(d.count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+}
+
+int main() try {
+    ac::whisper::initLibrary();
+
+    ac::whisper::Model model(AC_TEST_DATA_WHISPER_DIR "/whisper-base.en-f16.bin", {.gpu = false});
+
+    ac::whisper::Instance full(model, {});
+    ac::whisper::Instance autoCtx(model, {.autoAudioCtx = true});
+
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+
+    // warm up both instances
+    full.transcribe(pcmf32);
+    autoCtx.transcribe(pcmf32);
+
+    const int runs = 5;
+
+    std::printf("clip_ms,full_ctx_ms,auto_ctx_ms,speedup\n");
+    for (uint32_t ms : {1000, 2000, 3000, 5000, 8000, 10000}) {
+        auto clip = std::span(pcmf32).first(std::min(pcmf32.size(), size_t(ms) * 16));
+        auto fullMs = medianMs(full, clip, runs);
+        auto autoMs = medianMs(autoCtx, clip, runs);
+        std::printf("%u,%.1f,%.1f,%.2f\n", ms, fullMs, autoMs, fullMs / autoMs);
+    }
+
+    return 0;
+}
+catch (const std::exception& e) {
+    std::fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+}
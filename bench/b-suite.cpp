@@ -0,0 +1,177 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+
+// benchmark suite of the library
+// prints one json object per line, so results from different versions can be diffed
+//
+// * load: model load time
+// * instance: instance creation time with a newly allocated state
+// * instance_pooled: instance creation time with a state reused from the model's pool
+// * transcribe: for each clip, thread count and sampling strategy:
+//   total time, real-time factor, time to first segment, and mel/encoder/decoder split
+// * peak_rss: peak resident set size of the process at the end
+
+#include <ac/whisper/Init.hpp>
+#include <ac/whisper/Model.hpp>
+#include <ac/whisper/Instance.hpp>
+
+#include <ac-audio.hpp>
+
+#include "ac-test-data-whisper-dir.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#   define WIN32_LEAN_AND_MEAN
+#   define NOMINMAX
+#   include <Windows.h>
+#   include <psapi.h>
+#else
+#   include <sys/resource.h>
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double msSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+uint64_t peakRssKb() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return 0;
+    }
+    return pmc.PeakWorkingSetSize / 1024;
+#else
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#   if defined(__APPLE__)
+    return uint64_t(ru.ru_maxrss) / 1024; // bytes on macOS
+#   else
+    return uint64_t(ru.ru_maxrss); // kilobytes elsewhere
+#   endif
+#endif
+}
+
+double median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+struct Clip {
+    std::string name;
+    std::span<const float> pcm;
+};
+
+const char* strategyName(ac::whisper::Instance::InitParams::SamplingStrategy s) {
+    return s == ac::whisper::Instance::InitParams::GREEDY ? "greedy" : "beam_search";
+}
+
+}
+
+int main() try {
+    ac::whisper::initLibrary();
+
+    const int runs = 3;
+    const std::string modelName = "whisper-base.en-f16";
+    const std::string modelPath = AC_TEST_DATA_WHISPER_DIR "/" + modelName + ".bin";
+
+    // load
+    {
+        std::vector<double> times;
+        for (int i = 0; i < runs; ++i) {
+            auto start = Clock::now();
+            ac::whisper::Model model(modelPath.c_str(), {.gpu = false});
+            times.push_back(msSince(start));
+        }
+        std::printf(R"({"bench":"load","model":"%s","ms":%.2f})" "\n", modelName.c_str(), median(times));
+    }
+
+    ac::whisper::Model model(modelPath.c_str(), {.gpu = false});
+
+    // instance creation
+    {
+        // keep the instances alive, so that each one allocates a new state instead of reusing a pooled one
+        std::vector<std::unique_ptr<ac::whisper::Instance>> instances;
+        std::vector<double> times;
+        for (int i = 0; i < runs; ++i) {
+            auto start = Clock::now();
+            instances.push_back(std::make_unique<ac::whisper::Instance>(model, ac::whisper::Instance::InitParams{}));
+            times.push_back(msSince(start));
+        }
+        std::printf(R"({"bench":"instance","model":"%s","ms":%.2f})" "\n", modelName.c_str(), median(times));
+    }
+    {
+        // with a state from the model's pool
+        std::vector<double> times;
+        for (int i = 0; i < runs; ++i) {
+            auto start = Clock::now();
+            ac::whisper::Instance instance(model, {});
+            times.push_back(msSince(start));
+        }
+        std::printf(R"({"bench":"instance_pooled","model":"%s","ms":%.2f})" "\n", modelName.c_str(), median(times));
+    }
+
+    // transcription
+    std::vector<std::vector<float>> audio;
+    std::vector<Clip> clips;
+    for (auto name : {"yes", "as-she-sat", "prentice-hall"}) {
+        audio.push_back(ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/" + std::string(name) + ".wav"));
+    }
+    clips.push_back({"yes", audio[0]});
+    clips.push_back({"as-she-sat", audio[1]});
+    clips.push_back({"prentice-hall", audio[2]});
+    clips.push_back({"prentice-hall-5s", std::span(audio[2]).first(std::min(audio[2].size(), size_t(16000 * 5)))});
+
+    std::vector<int> threadCounts;
+    const int hw = int(std::max(1u, std::thread::hardware_concurrency()));
+    for (int t = 1; t <= hw && t <= 8; t *= 2) {
+        threadCounts.push_back(t);
+    }
+
+    for (auto strategy : {ac::whisper::Instance::InitParams::GREEDY, ac::whisper::Instance::InitParams::BEAM_SEARCH}) {
+        for (auto threads : threadCounts) {
+            ac::whisper::Instance instance(model, {.samplingStrategy = strategy, .nThreads = uint32_t(threads)});
+
+            for (auto& clip : clips) {
+                const double clipMs = double(clip.pcm.size()) * 1000 / 16000;
+
+                instance.transcribe(clip.pcm); // warm up
+                std::vector<ac::whisper::Timings> timings;
+                for (int i = 0; i < runs; ++i) {
+                    instance.transcribe(clip.pcm);
+                    timings.push_back(instance.lastTimings());
+                }
+
+                // run with the median total time
+                std::sort(timings.begin(), timings.end(), [](auto& a, auto& b) { return a.totalMs < b.totalMs; });
+                auto& t = timings[timings.size() / 2];
+
+                std::printf(R"({"bench":"transcribe","model":"%s","clip":"%s","clip_ms":%.0f,"threads":%d,"sampler":"%s",)"
+                    R"("total_ms":%.2f,"rtf":%.4f,"first_segment_ms":%.2f,"mel_ms":%.2f,"encode_ms":%.2f,"decode_ms":%.2f})" "\n",
+                    modelName.c_str(), clip.name.c_str(), clipMs, threads, strategyName(strategy),
+                    t.totalMs, t.totalMs / clipMs, t.firstSegmentMs, t.melMs, t.encodeMs, t.decodeMs);
+                std::fflush(stdout);
+            }
+        }
+    }
+
+    std::printf(R"({"bench":"peak_rss","kb":%llu})" "\n", (unsigned long long)peakRssKb());
+
+    return 0;
+}
+catch (const std::exception& e) {
+    std::fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+}
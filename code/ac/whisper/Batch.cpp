@@ -0,0 +1,227 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "Batch.hpp"
+#include "Model.hpp"
+
+#include <astl/throw_stdex.hpp>
+#include <astl/move.hpp>
+
+#include <whisper.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <thread>
+
+namespace ac::whisper {
+
+namespace {
+struct Chunk {
+    size_t begin;
+    size_t end;
+    size_t keepEnd; // segments starting after this are left to the next chunk (which overlaps this one)
+};
+
+std::vector<Chunk> splitAtSilences(std::span<const float> pcmf32, const Batch::LongFormParams& params) {
+    const size_t target = size_t(params.chunkMs) * WHISPER_SAMPLE_RATE / 1000;
+    const size_t overlap = size_t(params.overlapMs) * WHISPER_SAMPLE_RATE / 1000;
+
+    if (target == 0) {
+        throw_ex{} << "Chunk length must be positive!";
+    }
+
+    // candidate cut points: middles of the silences between speech regions
+    std::vector<size_t> silences;
+    {
+        auto regions = detectSpeech(pcmf32, params.vad);
+        for (size_t i = 1; i < regions.size(); ++i) {
+            silences.push_back((regions[i - 1].end + regions[i].begin) / 2);
+        }
+    }
+
+    std::vector<Chunk> ret;
+    size_t begin = 0;
+    while (begin < pcmf32.size()) {
+        const size_t ideal = begin + target;
+        if (ideal >= pcmf32.size()) {
+            ret.push_back({begin, pcmf32.size(), pcmf32.size()});
+            break;
+        }
+
+        // silence closest to the target length within half of it
+        const size_t lo = begin + target / 2, hi = ideal + target / 2;
+        size_t cut = 0;
+        for (auto it = std::lower_bound(silences.begin(), silences.end(), lo); it != silences.end() && *it <= hi; ++it) {
+            if (!cut || std::max(*it, ideal) - std::min(*it, ideal) < std::max(cut, ideal) - std::min(cut, ideal)) {
+                cut = *it;
+            }
+        }
+
+        if (cut) {
+            ret.push_back({begin, cut, cut});
+            begin = cut;
+        }
+        else {
+            // no silence around: cut at the target length and overlap with the next chunk
+            ret.push_back({begin, std::min(ideal + overlap, pcmf32.size()), ideal});
+            begin = ideal;
+        }
+    }
+    return ret;
+}
+
+int64_t samplesToMs(size_t samples) {
+    return int64_t(samples) * 1000 / WHISPER_SAMPLE_RATE;
+}
+}
+
+Batch::Batch(Model& model, Instance::InitParams instanceParams, Params params)
+    : m_model(model)
+    , m_params(astl::move(params))
+{
+    if (m_params.maxBatchSize == 0) {
+        throw_ex{} << "Batch size must be positive!";
+    }
+
+    if (m_params.nThreads == 0) {
+        m_params.nThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    instanceParams.nThreads = std::max(1u, m_params.nThreads / m_params.maxBatchSize);
+
+    m_instances.reserve(m_params.maxBatchSize);
+    for (uint32_t i = 0; i < m_params.maxBatchSize; ++i) {
+        m_instances.push_back(std::make_unique<Instance>(model, instanceParams));
+    }
+}
+
+Batch::~Batch() = default;
+
+void Batch::runQueue(size_t count, const std::function<void(Instance&, size_t)>& job) {
+    std::vector<std::exception_ptr> errors(m_instances.size());
+    std::atomic_size_t next = 0;
+
+    auto run = [&](size_t i) {
+        try {
+            // each instance takes the next item until all are done
+            for (size_t n = next++; n < count; n = next++) {
+                job(*m_instances[i], n);
+            }
+        }
+        catch (...) {
+            errors[i] = std::current_exception();
+            next = count;
+        }
+    };
+
+    {
+        const size_t numThreads = std::min(m_instances.size(), count);
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < numThreads; ++i) {
+            threads.emplace_back(run, i);
+        }
+        // the first instance runs on the calling thread
+        run(0);
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    for (auto& e : errors) {
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+}
+
+std::vector<std::string> Batch::transcribe(std::span<const std::span<const float>> inputs) {
+    std::vector<std::string> results(inputs.size());
+    runQueue(inputs.size(), [&](Instance& inst, size_t i) {
+        results[i] = inst.transcribe(inputs[i]);
+    });
+    return results;
+}
+
+Transcript Batch::transcribeLong(std::span<const float> pcmf32, const LongFormParams& params) {
+    const auto chunks = splitAtSilences(pcmf32, params);
+
+    std::vector<Transcript> results(chunks.size());
+    runQueue(chunks.size(), [&](Instance& inst, size_t c) {
+        auto& chunk = chunks[c];
+        results[c] = inst.runInference(pcmf32.subspan(chunk.begin, chunk.end - chunk.begin), true);
+    });
+
+    // stitch
+    // each chunk owns the part of the input up to the middle of its overlap with the next one (or up to the silence
+    // it was cut at), and contributes the tokens whose centers are in it
+    Transcript ret;
+    int64_t ownBegin = 0;
+    for (size_t c = 0; c < chunks.size(); ++c) {
+        auto& chunk = chunks[c];
+        auto& t = results[c];
+
+        const int64_t offset = samplesToMs(chunk.begin);
+        const int64_t ownEnd = c + 1 == chunks.size()
+            ? INT64_MAX
+            : samplesToMs((chunk.keepEnd + chunk.end) / 2);
+
+        if (ret.language.empty()) {
+            ret.language = t.language;
+        }
+        // summed over the chunks, so it's the compute time rather than the wall time
+        ret.timings += t.timings;
+
+        for (auto& s : t.segments) {
+            auto tokens = t.segmentTokens(s);
+
+            std::vector<Transcript::Token> owned;
+            for (auto token : tokens) {
+                token.t0 += offset;
+                token.t1 += offset;
+                const int64_t mid = (token.t0 + token.t1) / 2;
+                if (mid >= ownBegin && mid < ownEnd) {
+                    owned.push_back(token);
+                }
+            }
+            if (owned.empty()) {
+                continue;
+            }
+
+            auto seg = s;
+            std::string_view text = t.segmentText(s);
+            std::string clipped;
+            if (owned.size() == tokens.size()) {
+                seg.t0 += offset;
+                seg.t1 += offset;
+            }
+            else {
+                // the segment straddles the end of the owned part
+                for (auto& token : owned) {
+                    clipped += m_model.tokenText(token.id);
+                }
+                text = clipped;
+                seg.t0 = std::max(seg.t0 + offset, owned.front().t0);
+                seg.t1 = std::min(seg.t1 + offset, owned.back().t1);
+            }
+
+            seg.textOffset = uint32_t(ret.text.size());
+            seg.textLength = uint32_t(text.size());
+            ret.text += text;
+            ret.text += '\n';
+
+            seg.tokenOffset = uint32_t(ret.tokens.size());
+            seg.tokenCount = uint32_t(owned.size());
+            ret.tokens.insert(ret.tokens.end(), owned.begin(), owned.end());
+
+            ret.segments.push_back(seg);
+        }
+
+        ownBegin = ownEnd;
+    }
+
+    return ret;
+}
+
+} // namespace ac::whisper
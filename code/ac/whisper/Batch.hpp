@@ -0,0 +1,59 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+#include "Instance.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <span>
+#include <vector>
+
+namespace ac::whisper {
+class Model;
+
+// Transcribes groups of inputs concurrently on a set of instances of the same model
+// The available threads are split between the instances, so each input runs its mel and encoder with a share of
+// the cores, and its decoder (which scales poorly with threads) in parallel with the others.
+// This gives a substantially higher throughput on CPU than running the inputs one by one with all threads.
+class AC_WHISPER_EXPORT Batch {
+public:
+    struct Params {
+        uint32_t maxBatchSize = 4; // max inputs processed concurrently (and number of instances)
+        uint32_t nThreads = 0;     // total threads to split between the instances (0 - hardware concurrency)
+    };
+
+    Batch(Model& model, Instance::InitParams instanceParams, Params params);
+    ~Batch();
+
+    // inputs are processed by up to maxBatchSize instances, each of which takes the next input as soon as it's free
+    // results are in the same order as the inputs
+    std::vector<std::string> transcribe(std::span<const std::span<const float>> inputs);
+
+    struct LongFormParams {
+        uint32_t chunkMs = 60000;  // target length of chunks
+        uint32_t overlapMs = 1000; // overlap of chunks which couldn't be cut at a silence
+        VadParams vad;             // used to find silences to cut at
+    };
+
+    // transcribe a long input by splitting it into chunks (at silences where possible), transcribing the chunks
+    // concurrently, and stitching the results
+    // overlapping chunks are stitched at the middle of the overlap by the timestamps of their tokens, which are
+    // computed regardless of the instance params
+    Transcript transcribeLong(std::span<const float> pcmf32, const LongFormParams& params);
+
+    const Params& params() const noexcept { return m_params; }
+
+private:
+    // run job for items [0, count) on the instances concurrently, each instance taking the next item when it's done
+    // with the previous one. the first error stops the remaining items and is rethrown
+    void runQueue(size_t count, const std::function<void(Instance&, size_t)>& job);
+
+    Model& m_model;
+    Params m_params;
+    std::vector<std::unique_ptr<Instance>> m_instances;
+};
+
+} // namespace ac::whisper
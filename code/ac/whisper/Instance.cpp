@@ -4,6 +4,7 @@
 #include "Instance.hpp"
 #include "Model.hpp"
 #include "Logging.hpp"
+#include "Mel.hpp"
 
 #include <whisper.h>
 
@@ -11,6 +12,10 @@
 #include <astl/iile.h>
 #include <astl/move.hpp>
 #include <itlib/sentry.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <optional>
 #include <cassert>
 #include <span>
 
@@ -27,44 +32,535 @@ whisper_sampling_strategy whisperFromACStrategy(Instance::InitParams::SamplingSt
     }
 }
 
-whisper_full_params whisperFromInstanceParams(Instance::InitParams& iparams) {
+whisper_full_params whisperFromInstanceParams(const Instance::InitParams& iparams) {
     // The params setup is based the main example of whisper.cpp
     // https://github.com/alpaca-core/whisper.cpp/blob/6739eb83c3ca5cf40d24c6fe8442a761a1eb6248/examples/main/main.cpp#L1084
     whisper_full_params wparams = whisper_full_default_params(whisperFromACStrategy(iparams.samplingStrategy));
     wparams.print_progress   = false;
     wparams.print_timestamps = false;
-    wparams.max_len          = 60;
+
+    if (iparams.nThreads) {
+        wparams.n_threads = int(iparams.nThreads);
+    }
+
+    // max_len only has effect with token timestamps
+    wparams.token_timestamps = iparams.tokenTimestamps || iparams.maxLen;
+    wparams.max_len          = int(iparams.maxLen);
+
+    if (iparams.beamSize) {
+        wparams.beam_search.beam_size = int(iparams.beamSize);
+    }
+    if (iparams.bestOf) {
+        wparams.greedy.best_of = int(iparams.bestOf);
+    }
+
+    wparams.audio_ctx = int(iparams.audioCtx);
+
+    if (iparams.language != "auto" && whisper_lang_id(iparams.language.c_str()) == -1) {
+        throw_ex{} << "Unknown language: " << iparams.language;
+    }
+    // points to the string in iparams, which must outlive wparams
+    wparams.language        = iparams.language.c_str();
+    wparams.detect_language = false;
+    wparams.translate       = iparams.translate;
+
+    wparams.no_context     = iparams.noContext;
+    wparams.single_segment = iparams.singleSegment;
+
+    wparams.temperature     = iparams.temperature;
+    wparams.temperature_inc = iparams.temperatureInc;
+
+    wparams.max_tokens = int(iparams.maxTokens);
+    if (iparams.maxTextCtx) {
+        wparams.n_max_text_ctx = int(iparams.maxTextCtx);
+    }
 
     return wparams;
 }
+
+// the encoder produces one frame of context per 20ms of audio
+int autoAudioCtx(size_t samples, uint32_t minCtx, int fullCtx) {
+    const size_t samplesPerFrame = WHISPER_SAMPLE_RATE / 50;
+    // round up to a multiple of 64 to leave some slack at the end of the input
+    size_t ctx = (samples + samplesPerFrame - 1) / samplesPerFrame;
+    ctx = (ctx + 63) / 64 * 64;
+    ctx = std::max(ctx, size_t(minCtx));
+    return int(std::min(ctx, size_t(fullCtx)));
+}
+
+size_t msToSamples(uint32_t ms) {
+    return size_t(ms) * WHISPER_SAMPLE_RATE / 1000;
+}
+
+int64_t samplesToMs(size_t samples) {
+    return int64_t(samples) * 1000 / WHISPER_SAMPLE_RATE;
+}
 }
 
 Instance::Instance(Model& model, InitParams params)
     : m_model(model)
     , m_params(astl::move(params))
-    , m_state(whisper_init_state(model.context()), whisper_free_state)
-{}
+    , m_wparams(std::make_unique<whisper_full_params>(whisperFromInstanceParams(m_params)))
+    , m_state(model.acquireState())
+{
+    if (m_params.melFrontEnd) {
+        m_mel = std::make_unique<MelSpectrogram>(whisper_model_n_mels(model.context()));
+    }
+}
 
 Instance::~Instance() = default;
 
+double Instance::warmup() {
+    // whisper_full would leave the tokens of the warmup in the prompt of the next call, so use the lower level api
+    const auto start = std::chrono::steady_clock::now();
+
+    auto ctx = m_model.context();
+    auto state = m_state.get();
+    const int nThreads = m_wparams->n_threads;
+
+    std::vector<float> silence(WHISPER_SAMPLE_RATE, 0.f);
+    if (m_mel) {
+        m_mel->invalidate();
+        m_mel->compute(silence, uint32_t(nThreads));
+        if (whisper_set_mel_with_state(ctx, state, m_mel->data(), m_mel->nLen(), m_mel->nMel()) != 0) {
+            throw_ex{} << "Failed to warm up the spectrogram!";
+        }
+    }
+    else if (whisper_pcm_to_mel_with_state(ctx, state, silence.data(), int(silence.size()), nThreads) != 0) {
+        throw_ex{} << "Failed to warm up the spectrogram!";
+    }
+
+    if (whisper_encode_with_state(ctx, state, 0, nThreads) != 0) {
+        throw_ex{} << "Failed to warm up the encoder!";
+    }
+
+    const whisper_token prompt[] = {whisper_token_sot(ctx)};
+    if (whisper_decode_with_state(ctx, state, prompt, 1, 0, nThreads) != 0) {
+        throw_ex{} << "Failed to warm up the decoder!";
+    }
+
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
 std::string Instance::transcribe(std::span<const float> pcmf32) {
+    return runInference(pcmf32).text;
+}
+
+Transcript Instance::transcribeDetailed(std::span<const float> pcmf32) {
     return runInference(pcmf32);
 }
 
-std::string Instance::runInference(std::span<const float> pcmf32) {
-    auto wparams = whisperFromInstanceParams(m_params);
+std::string Instance::transcribe(std::span<const float> pcm, PcmFormat format) {
+    return transcribeDetailed(pcm, format).text;
+}
+
+std::string Instance::transcribe(std::span<const int16_t> pcm, PcmFormat format) {
+    return transcribeDetailed(pcm, format).text;
+}
+
+Transcript Instance::transcribeDetailed(std::span<const float> pcm, PcmFormat format) {
+    if (format.sampleRate == Pcm_sampleRate && format.channels == 1) {
+        return runInference(pcm);
+    }
+    return runInference(toWhisperPcm(pcm, format));
+}
+
+Transcript Instance::transcribeDetailed(std::span<const int16_t> pcm, PcmFormat format) {
+    return runInference(toWhisperPcm(pcm, format));
+}
+
+Transcript Instance::transcribeSpeech(std::span<const float> pcmf32, const VadParams& vadParams) {
+    auto regions = detectSpeech(pcmf32, vadParams);
+    if (regions.empty()) {
+        // nothing to transcribe (and nothing for whisper to hallucinate on)
+        return {};
+    }
+
+    // speech regions are transcribed together, separated by short silences so that whisper sees the pauses
+    const size_t gap = msToSamples(100);
+
+    struct RegionMapping {
+        int64_t speechMs; // start of region in the speech buffer
+        int64_t sourceMs; // start of region in the input
+    };
+    std::vector<RegionMapping> mapping;
+    mapping.reserve(regions.size());
+
+    std::vector<float> speech;
+    for (auto& r : regions) {
+        if (!speech.empty()) {
+            speech.resize(speech.size() + gap, 0.f);
+        }
+        mapping.push_back({
+            .speechMs = samplesToMs(speech.size()),
+            .sourceMs = samplesToMs(r.begin)
+        });
+        speech.insert(speech.end(), pcmf32.begin() + r.begin, pcmf32.begin() + r.end);
+    }
+
+    auto result = runInference(speech);
+
+    auto toSource = [&](int64_t ms) {
+        auto it = std::upper_bound(mapping.begin(), mapping.end(), ms, [](int64_t t, const RegionMapping& m) {
+            return t < m.speechMs;
+        });
+        if (it != mapping.begin()) {
+            --it;
+        }
+        return it->sourceMs + (ms - it->speechMs);
+    };
+
+    for (auto& seg : result.segments) {
+        seg.t0 = toSource(seg.t0);
+        seg.t1 = toSource(seg.t1);
+    }
+    for (auto& token : result.tokens) {
+        if (token.t0 >= 0) {
+            token.t0 = toSource(token.t0);
+            token.t1 = toSource(token.t1);
+        }
+    }
+
+    return result;
+}
+
+void Instance::runFull(std::span<const float> pcmf32, const whisper_full_params& params, MelSpectrogram* mel) {
+    auto wparams = params;
+    if (m_params.autoAudioCtx && !wparams.audio_ctx) {
+        wparams.audio_ctx = autoAudioCtx(pcmf32.size(), m_params.minAudioCtx, whisper_n_audio_ctx(m_model.context()));
+    }
+
+    if (m_cancelled) {
+        throw_ex{} << "Inference cancelled!";
+    }
+    if (m_deadline && std::chrono::steady_clock::now() >= *m_deadline) {
+        throw_ex{} << "Inference deadline exceeded!";
+    }
+
+    // whisper.cpp keeps its timings in the state but doesn't expose them, so we measure with its callbacks:
+    // mel is computed before the first encoder pass, and the first logits of a window mark the end of its encoding
+    // the callbacks also abort the run when it's cancelled or past its deadline
+    struct RunCtx {
+        using Clock = std::chrono::steady_clock;
+
+        const std::atomic_bool& cancelled;
+        std::optional<Clock::time_point> deadline;
+        std::atomic_bool aborted = false;
+
+        Clock::time_point start = Clock::now();
+        Clock::time_point encodeBegin;
+        std::atomic_bool encoding = false; // logits may be processed by several threads
+        std::optional<Clock::time_point> melEnd;
+        Timings timings;
+
+        double msSince(Clock::time_point t) const {
+            return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+        }
+
+        bool abort() {
+            if (cancelled || (deadline && Clock::now() >= *deadline)) {
+                aborted = true;
+            }
+            return aborted;
+        }
+    } tctx{m_cancelled, m_deadline};
+
+    wparams.encoder_begin_callback_user_data = &tctx;
+    wparams.encoder_begin_callback = [](whisper_context*, whisper_state*, void* user) {
+        auto& t = *static_cast<RunCtx*>(user);
+        auto now = RunCtx::Clock::now();
+        if (!t.melEnd) {
+            t.melEnd = now;
+        }
+        t.encodeBegin = now;
+        t.encoding = true;
+        ++t.timings.encoderPasses;
+        return !t.abort();
+    };
+    // checked by ggml during graph computations
+    wparams.abort_callback_user_data = &tctx;
+    wparams.abort_callback = [](void* user) {
+        return static_cast<RunCtx*>(user)->abort();
+    };
+    wparams.logits_filter_callback_user_data = &tctx;
+    wparams.logits_filter_callback = [](whisper_context*, whisper_state*, const whisper_token_data*, int, float*, void* user) {
+        auto& t = *static_cast<RunCtx*>(user);
+        if (t.encoding.exchange(false)) {
+            t.timings.encodeMs += t.msSince(t.encodeBegin);
+        }
+    };
+    wparams.new_segment_callback_user_data = &tctx;
+    wparams.new_segment_callback = [](whisper_context*, whisper_state*, int, void* user) {
+        auto& t = *static_cast<RunCtx*>(user);
+        if (t.timings.firstSegmentMs < 0) {
+            t.timings.firstSegmentMs = t.msSince(t.start);
+        }
+    };
+
+    // whisper.cpp clears the text context of the state when no_context is set
+    if (m_clearContext) {
+        wparams.no_context = true;
+    }
+
+    // our spectrogram doesn't provide the signal energy which whisper.cpp uses for token timestamps
+    const bool ownMel = mel && !wparams.token_timestamps && pcmf32.size() >= MelSpectrogram::frameSize;
 
-    if (whisper_full_with_state(m_model.context(), m_state.get(), wparams, pcmf32.data(), int(pcmf32.size())) != 0) {
+    int ret;
+    if (ownMel) {
+        mel->compute(pcmf32, uint32_t(wparams.n_threads));
+        ret = whisper_set_mel_with_state(m_model.context(), m_state.get(), mel->data(), mel->nLen(), mel->nMel());
+        if (ret == 0) {
+            // the spectrogram includes the silence after the audio, which whisper.cpp excludes from the input
+            wparams.offset_ms = 0;
+            wparams.duration_ms = mel->nLenOrg() * 10;
+            ret = whisper_full_with_state(m_model.context(), m_state.get(), wparams, nullptr, 0);
+            m_clearContext = false;
+        }
+    }
+    else {
+        ret = whisper_full_with_state(m_model.context(), m_state.get(), wparams, pcmf32.data(), int(pcmf32.size()));
+        m_clearContext = false;
+    }
+
+    auto& t = tctx.timings;
+    t.totalMs = tctx.msSince(tctx.start);
+    if (tctx.encoding) {
+        // no decoding after the last pass
+        t.encodeMs += tctx.msSince(tctx.encodeBegin);
+    }
+    t.melMs = tctx.melEnd ? std::chrono::duration<double, std::milli>(*tctx.melEnd - tctx.start).count() : t.totalMs;
+    t.decodeMs = std::max(0.0, t.totalMs - t.melMs - t.encodeMs);
+    t.runs = 1;
+    t.audioSamples = pcmf32.size();
+
+    m_lastTimings = t;
+    m_totalTimings += t;
+
+    // whisper.cpp returns the partial result if encoder_begin_callback aborts it, so check our flag too
+    if (tctx.aborted) {
+        if (m_cancelled) {
+            throw_ex{} << "Inference cancelled!";
+        }
+        throw_ex{} << "Inference deadline exceeded!";
+    }
+    if (ret != 0) {
         throw_ex{} << "Failed to process audio!";
     }
+}
+
+Transcript Instance::runInference(std::span<const float> pcmf32, bool tokenTimestamps) {
+    auto wparams = *m_wparams;
+    if (tokenTimestamps) {
+        wparams.token_timestamps = true;
+    }
+
+    if (m_mel) {
+        m_mel->invalidate();
+    }
+    runFull(pcmf32, wparams, m_mel.get());
+
+    auto ctx = m_model.context();
+    auto state = m_state.get();
+    const auto eot = whisper_token_eot(ctx);
+
+    Transcript result;
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+    result.segments.reserve(n_segments);
 
-    std::string result;
-    const int n_segments = whisper_full_n_segments_from_state(m_state.get());
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text_from_state(m_state.get(), i);
-        result += std::string(text) + "\n";
+        auto& seg = result.segments.emplace_back();
+
+        // whisper timestamps are in centiseconds
+        seg.t0 = whisper_full_get_segment_t0_from_state(state, i) * 10;
+        seg.t1 = whisper_full_get_segment_t1_from_state(state, i) * 10;
+        seg.noSpeechProb = whisper_full_get_segment_no_speech_prob_from_state(state, i);
+
+        std::string_view text = whisper_full_get_segment_text_from_state(state, i);
+        seg.textOffset = uint32_t(result.text.size());
+        seg.textLength = uint32_t(text.size());
+        result.text += text;
+        result.text += '\n';
+
+        seg.tokenOffset = uint32_t(result.tokens.size());
+        const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+        for (int j = 0; j < n_tokens; ++j) {
+            auto data = whisper_full_get_token_data_from_state(state, i, j);
+            if (data.id >= eot) {
+                continue;
+            }
+            auto& token = result.tokens.emplace_back();
+            token.id = data.id;
+            token.p = data.p;
+            token.plog = data.plog;
+            if (wparams.token_timestamps) {
+                token.t0 = data.t0 * 10;
+                token.t1 = data.t1 * 10;
+            }
+        }
+        seg.tokenCount = uint32_t(result.tokens.size()) - seg.tokenOffset;
     }
 
+    if (auto lang = whisper_lang_str(whisper_full_lang_id_from_state(state))) {
+        result.language = lang;
+    }
+
+    result.timings = m_lastTimings;
+
     return result;
 }
+
+void Instance::beginStream(StreamParams params) {
+    if (params.stepMs == 0 || params.lengthMs < params.stepMs || params.keepMs >= params.lengthMs) {
+        throw_ex{} << "Invalid stream params!";
+    }
+
+    m_stream = {};
+    m_stream.params = params;
+    m_stream.active = true;
+    if (m_params.melFrontEnd) {
+        m_stream.mel = std::make_unique<MelSpectrogram>(whisper_model_n_mels(m_model.context()));
+    }
+}
+
+void Instance::pushAudio(std::span<const float> pcmf32) {
+    if (!m_stream.active) {
+        throw_ex{} << "No active stream!";
+    }
+    m_stream.window.insert(m_stream.window.end(), pcmf32.begin(), pcmf32.end());
+    m_stream.pendingSamples += pcmf32.size();
+}
+
+void Instance::pushAudio(std::span<const int16_t> pcms16) {
+    pushAudio(toWhisperPcm(pcms16));
+}
+
+std::vector<Instance::StreamSegment> Instance::poll() {
+    if (!m_stream.active) {
+        throw_ex{} << "No active stream!";
+    }
+    // a full window is processed regardless of the step, so that it never grows past lengthMs
+    if (m_stream.pendingSamples < msToSamples(m_stream.params.stepMs)
+        && m_stream.window.size() < msToSamples(m_stream.params.lengthMs)
+    ) {
+        return {};
+    }
+    return runStreamStep(false);
+}
+
+std::vector<Instance::StreamSegment> Instance::finish() {
+    if (!m_stream.active) {
+        throw_ex{} << "No active stream!";
+    }
+
+    itlib::sentry end([&] { endStream(); });
+
+    if (m_stream.window.size() <= m_stream.finalizedSamples) {
+        // the window only holds audio which was already finalized
+        return {};
+    }
+    return runStreamStep(true);
+}
+
+void Instance::endStream() noexcept {
+    m_stream = {};
+}
+
+std::vector<Instance::StreamSegment> Instance::runStreamStep(bool flush) {
+    auto& s = m_stream;
+    s.pendingSamples = 0;
+
+    auto wparams = *m_wparams;
+    // context between windows is provided by us through the prompt
+    wparams.no_context = true;
+    wparams.prompt_tokens = s.promptTokens.empty() ? nullptr : s.promptTokens.data();
+    wparams.prompt_n_tokens = int(s.promptTokens.size());
+
+    runFull(s.window, wparams, s.mel.get());
+
+    auto ctx = m_model.context();
+    auto state = m_state.get();
+
+    const int64_t windowSamples = int64_t(s.window.size());
+    const bool windowFull = windowSamples >= int64_t(msToSamples(s.params.lengthMs));
+    const int nSegments = whisper_full_n_segments_from_state(state);
+
+    // the last segment may still grow with more audio, so unless we're flushing or out of window space
+    // only the segments before it are considered final
+    int nFinal = 0;
+    if (flush || windowFull) {
+        nFinal = nSegments;
+    }
+    else if (nSegments > 1) {
+        nFinal = nSegments - 1;
+    }
+
+    std::vector<StreamSegment> ret;
+    ret.reserve(nSegments);
+
+    const int64_t windowOffsetMs = s.windowOffset * 1000 / WHISPER_SAMPLE_RATE;
+    int64_t finalEnd = 0; // end of the finalized part of the window in samples
+
+    for (int i = 0; i < nSegments; ++i) {
+        // whisper timestamps are in centiseconds
+        const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i) * 10;
+        const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i) * 10;
+        const int64_t t1Samples = std::min(t1 * WHISPER_SAMPLE_RATE / 1000, windowSamples);
+
+        if (t1Samples <= int64_t(s.finalizedSamples)) {
+            // the kept audio at the front of the window was already emitted as final
+            continue;
+        }
+
+        auto& seg = ret.emplace_back();
+        seg.text = whisper_full_get_segment_text_from_state(state, i);
+        seg.t0 = windowOffsetMs + t0;
+        seg.t1 = windowOffsetMs + t1;
+        seg.final = i < nFinal;
+
+        if (!seg.final) {
+            continue;
+        }
+
+        finalEnd = t1Samples;
+
+        const int nTokens = whisper_full_n_tokens_from_state(state, i);
+        for (int j = 0; j < nTokens; ++j) {
+            auto token = whisper_full_get_token_id_from_state(state, i, j);
+            if (token < whisper_token_eot(ctx)) {
+                s.promptTokens.push_back(token);
+            }
+        }
+    }
+
+    if (flush) {
+        return ret;
+    }
+
+    if (nFinal == nSegments) {
+        // everything in the window is final (or there was nothing to transcribe in a full window)
+        finalEnd = windowFull ? windowSamples : finalEnd;
+    }
+
+    if (finalEnd > 0) {
+        finalEnd = std::max(finalEnd, int64_t(s.finalizedSamples));
+        int64_t drop = std::max(int64_t(0), finalEnd - int64_t(msToSamples(s.params.keepMs)));
+        // keep whole spectrogram frames so that the ones of the remaining audio can be reused
+        drop = drop / int64_t(MelSpectrogram::hop) * int64_t(MelSpectrogram::hop);
+        s.window.erase(s.window.begin(), s.window.begin() + drop);
+        s.windowOffset += drop;
+        if (s.mel) {
+            s.mel->dropFront(size_t(drop));
+        }
+        s.finalizedSamples = size_t(finalEnd - drop);
+    }
+
+    // limit the prompt to a half of the text context, the same way whisper.cpp does internally
+    const size_t maxPrompt = size_t(whisper_n_text_ctx(ctx) / 2);
+    if (s.promptTokens.size() > maxPrompt) {
+        s.promptTokens.erase(s.promptTokens.begin(), s.promptTokens.end() - maxPrompt);
+    }
+
+    return ret;
+}
 } // namespace ac::whisper
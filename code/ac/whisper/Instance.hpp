@@ -3,17 +3,27 @@
 //
 #pragma once
 #include "export.h"
+#include "Transcript.hpp"
+#include "Timings.hpp"
+#include "Vad.hpp"
+#include "Pcm.hpp"
+#include "Model.hpp"
 
-#include <astl/mem_ext.hpp>
-
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <functional>
+#include <optional>
+#include <memory>
 #include <string>
 #include <span>
+#include <vector>
 
 struct whisper_state;
+struct whisper_full_params;
 
 namespace ac::whisper {
-class Model;
+class MelSpectrogram;
 
 class AC_WHISPER_EXPORT Instance {
 public:
@@ -23,19 +33,153 @@ public:
             BEAM_SEARCH, // similar to OpenAI's BeamSearchDecoder
         };
         SamplingStrategy samplingStrategy = GREEDY;
+
+        uint32_t nThreads = 0; // threads for inference (0 - whisper.cpp default)
+
+        bool tokenTimestamps = false; // compute timestamps of individual tokens
+
+        uint32_t beamSize = 0; // beams for BEAM_SEARCH (0 - whisper.cpp default)
+        uint32_t bestOf = 0;   // candidates sampled with GREEDY at non-zero temperature (0 - whisper.cpp default)
+
+        // size of the encoder audio context (0 - the model's full context of 30s)
+        // smaller values are much faster for short inputs at the cost of accuracy
+        uint32_t audioCtx = 0;
+
+        // size the audio context to the length of each input which is shorter than the full context
+        // only used when audioCtx is 0. the size is never less than minAudioCtx (in 20ms frames) to preserve accuracy
+        bool autoAudioCtx = false;
+        uint32_t minAudioCtx = 256;
+
+        std::string language = "en"; // spoken language ("auto" to detect it)
+        bool translate = false;      // translate to english
+
+        // don't use the text of the previous call as a prompt for the next one (false - carry it over)
+        // carrying the prompt over only makes sense for consecutive parts of the same audio
+        bool noContext = true;
+        bool singleSegment = false; // force a single segment output
+
+        float temperature = 0;
+        float temperatureInc = 0.2f; // temperature increase on decoding failure (0 - no fallback)
+
+        uint32_t maxTokens = 0;  // max tokens per segment (0 - no limit)
+        uint32_t maxTextCtx = 0; // max tokens of past text to use as a prompt (0 - whisper.cpp default)
+        uint32_t maxLen = 0;     // max characters per segment (0 - no limit). enables token timestamps
+
+        // compute the spectrogram with our front end instead of whisper.cpp's
+        // it skips the 30s of silence whisper.cpp appends to each input and, when streaming, only computes the new audio
+        // not used with token timestamps, which need the signal energy that whisper.cpp computes with its own
+        bool melFrontEnd = true;
     };
 
     Instance(Model& model, InitParams params);
     ~Instance();
 
+    // run the spectrogram, the encoder, and a decoder step on silence, so that the first real call doesn't pay
+    // for lazy allocations, faulting in the weights, and cold caches
+    // doesn't affect the results or timings of later calls. returns the duration in ms
+    double warmup();
+
     std::string transcribe(std::span<const float> pcmf32);
 
+    // segments with timestamps, tokens with probabilities, and the detected language
+    Transcript transcribeDetailed(std::span<const float> pcmf32);
+
+    // audio in other formats is converted to 16 kHz mono float32 before inference
+    std::string transcribe(std::span<const float> pcm, PcmFormat format);
+    std::string transcribe(std::span<const int16_t> pcm, PcmFormat format = {});
+    Transcript transcribeDetailed(std::span<const float> pcm, PcmFormat format);
+    Transcript transcribeDetailed(std::span<const int16_t> pcm, PcmFormat format = {});
+
+    // transcribe only the speech regions of the input
+    // timestamps in the result are relative to the original input
+    Transcript transcribeSpeech(std::span<const float> pcmf32, const VadParams& vadParams);
+
+    // streaming
+    // audio is pushed incrementally and inference runs on a sliding window over it
+    // segments are emitted as partial (to be replaced by the next poll) or final
+    struct StreamParams {
+        uint32_t stepMs = 500;    // run inference when at least this much new audio is available
+        uint32_t lengthMs = 10000; // max window length; segments are finalized when it is reached
+        uint32_t keepMs = 200;     // audio from the end of the finalized part to keep in the next window
+    };
+
+    struct StreamSegment {
+        std::string text;
+        int64_t t0 = 0; // start in ms from the beginning of the stream
+        int64_t t1 = 0; // end in ms from the beginning of the stream
+        bool final = false;
+    };
+
+    void beginStream(StreamParams params);
+    void pushAudio(std::span<const float> pcmf32);
+    void pushAudio(std::span<const int16_t> pcms16); // 16 kHz mono
+
+    // run inference if enough audio has accumulated since the last step
+    // returns the newly finalized segments, followed by the current partial ones (if any)
+    std::vector<StreamSegment> poll();
+
+    // process all remaining audio, finalize all segments, and end the stream
+    std::vector<StreamSegment> finish();
+
+    // end the stream, discarding the audio which was not finalized (no-op if there is no active stream)
+    void endStream() noexcept;
+
+    bool streaming() const noexcept { return m_stream.active; }
+
+    // samples in the current window of the stream. never more than lengthMs after poll
+    size_t streamWindowSize() const noexcept { return m_stream.window.size(); }
+
+    // stop the running inference from any thread
+    // the running call throws, as do all later ones until resetCancel is called
+    void cancel() noexcept { m_cancelled = true; }
+    void resetCancel() noexcept { m_cancelled = false; }
+    bool cancelled() const noexcept { return m_cancelled; }
+
+    // inference which is still running at the deadline is aborted and throws (nullopt - no deadline)
+    // unlike cancel, this must not be called while inference is running
+    using Deadline = std::optional<std::chrono::steady_clock::time_point>;
+    void setDeadline(Deadline deadline) noexcept { m_deadline = deadline; }
+    const Deadline& deadline() const noexcept { return m_deadline; }
+
+    // timings of the last inference run
+    const Timings& lastTimings() const noexcept { return m_lastTimings; }
+
+    // cumulative timings of all runs since creation or the last reset
+    const Timings& totalTimings() const noexcept { return m_totalTimings; }
+    void resetTotalTimings() noexcept { m_totalTimings = {}; }
+
 private:
-    std::string runInference(std::span<const float> pcmf32);
+    friend class Batch;
+
+    // tokenTimestamps: compute the timestamps of tokens regardless of the params
+    Transcript runInference(std::span<const float> pcmf32, bool tokenTimestamps = false);
+    void runFull(std::span<const float> pcmf32, const whisper_full_params& wparams, MelSpectrogram* mel);
+    std::vector<StreamSegment> runStreamStep(bool flush);
 
     Model& m_model;
-    InitParams m_params;
-    astl::c_unique_ptr<whisper_state> m_state;
+    const InitParams m_params;
+    std::unique_ptr<whisper_full_params> m_wparams; // built from m_params once
+    Model::StatePtr m_state; // from the model's pool of states
+    bool m_clearContext = true; // the state may have the text context of a previous instance
+    std::unique_ptr<MelSpectrogram> m_mel; // null if melFrontEnd is off
+
+    Timings m_lastTimings;
+    Timings m_totalTimings;
+
+    std::atomic_bool m_cancelled = false;
+    Deadline m_deadline;
+
+    struct StreamState {
+        StreamParams params;
+        bool active = false;
+        std::vector<float> window;         // audio in the current window
+        int64_t windowOffset = 0;          // offset of the window in samples from the beginning of the stream
+        size_t pendingSamples = 0;         // samples pushed since the last step
+        size_t finalizedSamples = 0;       // samples at the front of the window covered by finalized segments
+        std::vector<int32_t> promptTokens; // tokens of the finalized text, used as a prompt for the next window
+        std::unique_ptr<MelSpectrogram> mel; // spectrogram of the window, updated incrementally
+    };
+    StreamState m_stream;
 };
 
 } // namespace ac::whisper
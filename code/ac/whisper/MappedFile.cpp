@@ -0,0 +1,138 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "MappedFile.hpp"
+
+#include <astl/throw_stdex.hpp>
+
+#include <algorithm>
+
+#if defined(_WIN32)
+#   define WIN32_LEAN_AND_MEAN
+#   define NOMINMAX
+#   include <Windows.h>
+#else
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+namespace ac::whisper {
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile(const char* path) {
+    m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        m_file = nullptr;
+        throw_ex{} << "Failed to open " << path;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size)) {
+        CloseHandle(m_file);
+        throw_ex{} << "Failed to get the size of " << path;
+    }
+    m_size = size_t(size.QuadPart);
+
+    if (m_size == 0) {
+        return;
+    }
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mapping) {
+        CloseHandle(m_file);
+        throw_ex{} << "Failed to create a mapping of " << path;
+    }
+
+    m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_data) {
+        CloseHandle(m_mapping);
+        CloseHandle(m_file);
+        throw_ex{} << "Failed to map " << path;
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping) {
+        CloseHandle(m_mapping);
+    }
+    if (m_file) {
+        CloseHandle(m_file);
+    }
+}
+
+void MappedFile::adviseSequential() noexcept {
+    // FILE_FLAG_SEQUENTIAL_SCAN is set on open
+}
+
+void MappedFile::releaseBefore(size_t offset) noexcept {
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    offset = std::min(offset, m_size) / si.dwPageSize * si.dwPageSize;
+    if (offset) {
+        // unlocking pages which aren't locked removes them from the working set
+        VirtualUnlock(const_cast<uint8_t*>(m_data), offset);
+    }
+}
+
+#else
+
+MappedFile::MappedFile(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        throw_ex{} << "Failed to open " << path;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw_ex{} << "Failed to get the size of " << path;
+    }
+    m_size = size_t(st.st_size);
+
+    if (m_size == 0) {
+        close(fd);
+        return;
+    }
+
+    void* addr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping keeps the file referenced
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        throw_ex{} << "Failed to map " << path;
+    }
+    m_data = static_cast<const uint8_t*>(addr);
+}
+
+MappedFile::~MappedFile() {
+    if (m_data) {
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+    }
+}
+
+void MappedFile::adviseSequential() noexcept {
+    if (m_data) {
+        auto addr = const_cast<uint8_t*>(m_data);
+        posix_madvise(addr, m_size, POSIX_MADV_SEQUENTIAL);
+    }
+}
+
+void MappedFile::releaseBefore(size_t offset) noexcept {
+    const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    offset = std::min(offset, m_size) / page * page;
+    if (offset) {
+        // not posix_madvise: glibc ignores POSIX_MADV_DONTNEED
+        madvise(const_cast<uint8_t*>(m_data), offset, MADV_DONTNEED);
+    }
+}
+
+#endif
+
+} // namespace ac::whisper
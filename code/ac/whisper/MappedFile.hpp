@@ -0,0 +1,38 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace ac::whisper {
+
+// read-only memory mapping of a whole file
+class MappedFile {
+public:
+    explicit MappedFile(const char* path); // throws on error
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::span<const uint8_t> data() const noexcept { return {m_data, m_size}; }
+
+    // hint the os that the file will be read sequentially
+    void adviseSequential() noexcept;
+
+    // drop the pages before offset from the memory of the process
+    // they stay in the page cache, so the data is still valid and cheap to read again
+    void releaseBefore(size_t offset) noexcept;
+
+private:
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+#if defined(_WIN32)
+    void* m_file = nullptr;
+    void* m_mapping = nullptr;
+#endif
+};
+
+} // namespace ac::whisper
@@ -0,0 +1,386 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "Mel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <map>
+#include <mutex>
+#include <numbers>
+#include <thread>
+
+namespace ac::whisper {
+
+namespace {
+constexpr size_t Sample_rate = 16000;
+constexpr size_t Pad_samples = 30 * Sample_rate; // silence appended to the input by whisper.cpp
+constexpr size_t Reflect = MelSpectrogram::frameSize / 2; // reflected samples at the front
+constexpr size_t N_fft = MelSpectrogram::frameSize / 2 + 1; // bins of the power spectrum
+constexpr float Log_silence = -10; // log10 of the clamped power of silence
+
+// frames which are affected by the reflection at the front
+constexpr size_t Reflect_frames = (Reflect + MelSpectrogram::hop - 1) / MelSpectrogram::hop;
+
+// frames which don't change when audio is appended to n samples
+size_t stableFrames(size_t n) {
+    const size_t end = Reflect + n;
+    if (end < MelSpectrogram::frameSize) {
+        return 0;
+    }
+    return (end - MelSpectrogram::frameSize) / MelSpectrogram::hop + 1;
+}
+
+using cfloat = std::complex<float>;
+
+// std::complex multiplication handles inf and nan, which makes it an out-of-line call without -ffast-math
+inline cfloat mul(cfloat a, cfloat b) {
+    return {a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real()};
+}
+} // namespace
+
+// the Hann window, the mel filterbank, and the FFT of the real frames
+// The FFT of a frame is a complex FFT of half the size (a mixed radix Stockham FFT with precomputed twiddles)
+// of the even and odd samples, which are then split into the spectrum of the frame.
+struct MelSpectrogram::Plan {
+    int nMel;
+
+    std::vector<float> window;
+
+    struct Stage {
+        size_t radix;
+        size_t m;      // n / radix
+        size_t stride;
+        size_t twiddles; // offset in twiddles: [p][k] for p < m, k < radix
+    };
+    std::vector<Stage> stages;
+    std::vector<cfloat> twiddles;
+    std::vector<cfloat> dft[6]; // dft matrices of the radices: [k][j]
+    std::vector<cfloat> split;  // twiddles of the real split: [k] for k <= frameSize / 2
+
+    // mel filters are sparse: the weights of filter i apply to the bins [begin, begin + weights.size())
+    struct Filter {
+        size_t begin;
+        std::vector<float> weights;
+    };
+    std::vector<Filter> filters;
+
+    explicit Plan(int nMel_) : nMel(nMel_) {
+        constexpr size_t n = frameSize;
+        constexpr size_t half = n / 2;
+
+        // periodic Hann window, as in whisper.cpp
+        window.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            window[i] = float(0.5 * (1.0 - std::cos(2.0 * std::numbers::pi * double(i) / double(n))));
+        }
+
+        // 200 = 4 * 2 * 5 * 5
+        size_t len = half, stride = 1, rest = half;
+        for (size_t radix : {4, 2, 5, 3}) {
+            while (rest % radix == 0) {
+                rest /= radix;
+                Stage st;
+                st.radix = radix;
+                st.m = len / radix;
+                st.stride = stride;
+                st.twiddles = twiddles.size();
+                for (size_t p = 0; p < st.m; ++p) {
+                    for (size_t k = 0; k < radix; ++k) {
+                        twiddles.push_back(cfloat(std::polar(1.0, -2 * std::numbers::pi * double(p * k) / double(len))));
+                    }
+                }
+                stages.push_back(st);
+                len = st.m;
+                stride *= radix;
+            }
+        }
+
+        for (size_t radix = 2; radix <= 5; ++radix) {
+            for (size_t k = 0; k < radix; ++k) {
+                for (size_t j = 0; j < radix; ++j) {
+                    dft[radix].push_back(cfloat(std::polar(1.0, -2 * std::numbers::pi * double(j * k % radix) / double(radix))));
+                }
+            }
+        }
+
+        for (size_t k = 0; k <= half; ++k) {
+            split.push_back(cfloat(std::polar(1.0, -2 * std::numbers::pi * double(k) / double(n))));
+        }
+
+        // slaney-style filterbank as in librosa.filters.mel(sr=16000, n_fft=400, n_mels=nMel), which whisper uses
+        auto hzToMel = [](double hz) {
+            constexpr double fsp = 200.0 / 3, minLogHz = 1000, minLogMel = minLogHz / fsp;
+            const double logStep = std::log(6.4) / 27;
+            return hz >= minLogHz ? minLogMel + std::log(hz / minLogHz) / logStep : hz / fsp;
+        };
+        auto melToHz = [](double mel) {
+            constexpr double fsp = 200.0 / 3, minLogHz = 1000, minLogMel = minLogHz / fsp;
+            const double logStep = std::log(6.4) / 27;
+            return mel >= minLogMel ? minLogHz * std::exp(logStep * (mel - minLogMel)) : fsp * mel;
+        };
+
+        const double maxMel = hzToMel(Sample_rate / 2.0);
+        std::vector<double> melF(nMel + 2);
+        for (int i = 0; i < nMel + 2; ++i) {
+            melF[i] = melToHz(maxMel * i / (nMel + 1));
+        }
+
+        filters.resize(nMel);
+        for (int i = 0; i < nMel; ++i) {
+            const double enorm = 2.0 / (melF[i + 2] - melF[i]);
+            auto& f = filters[i];
+            f.begin = N_fft;
+            for (size_t k = 0; k < N_fft; ++k) {
+                const double hz = double(k) * Sample_rate / n;
+                const double lower = (hz - melF[i]) / (melF[i + 1] - melF[i]);
+                const double upper = (melF[i + 2] - hz) / (melF[i + 2] - melF[i + 1]);
+                const double w = std::max(0.0, std::min(lower, upper));
+                if (w <= 0) {
+                    if (f.begin != N_fft) {
+                        break; // past the filter
+                    }
+                    continue;
+                }
+                if (f.begin == N_fft) {
+                    f.begin = k;
+                }
+                f.weights.push_back(float(w * enorm));
+            }
+            if (f.begin == N_fft) {
+                f.begin = 0;
+            }
+        }
+    }
+
+    // in and tmp have frameSize / 2 elements, the result is in either in or tmp (the returned pointer)
+    cfloat* fft(cfloat* in, cfloat* tmp) const {
+        cfloat* x = in;
+        cfloat* y = tmp;
+        for (auto& st : stages) {
+            const cfloat* tw = twiddles.data() + st.twiddles;
+            const size_t s = st.stride;
+            const size_t m = st.m;
+            for (size_t p = 0; p < m; ++p, tw += st.radix) {
+                cfloat* out = y + s * st.radix * p;
+                const cfloat* src = x + s * p;
+                if (st.radix == 4) {
+                    for (size_t q = 0; q < s; ++q) {
+                        const cfloat a0 = src[q], a1 = src[q + s * m], a2 = src[q + 2 * s * m], a3 = src[q + 3 * s * m];
+                        const cfloat b0 = a0 + a2, b1 = a0 - a2, b2 = a1 + a3, d = a1 - a3;
+                        const cfloat b3(d.imag(), -d.real()); // -i * (a1 - a3)
+                        out[q] = b0 + b2;
+                        out[q + s] = mul(b1 + b3, tw[1]);
+                        out[q + 2 * s] = mul(b0 - b2, tw[2]);
+                        out[q + 3 * s] = mul(b1 - b3, tw[3]);
+                    }
+                }
+                else if (st.radix == 2) {
+                    for (size_t q = 0; q < s; ++q) {
+                        const cfloat a0 = src[q], a1 = src[q + s * m];
+                        out[q] = a0 + a1;
+                        out[q + s] = mul(a0 - a1, tw[1]);
+                    }
+                }
+                else {
+                    const cfloat* w = dft[st.radix].data();
+                    for (size_t q = 0; q < s; ++q) {
+                        cfloat a[5];
+                        for (size_t j = 0; j < st.radix; ++j) {
+                            a[j] = src[q + j * s * m];
+                        }
+                        for (size_t k = 0; k < st.radix; ++k) {
+                            cfloat sum = a[0];
+                            for (size_t j = 1; j < st.radix; ++j) {
+                                sum += mul(a[j], w[k * st.radix + j]);
+                            }
+                            out[q + k * s] = k ? mul(sum, tw[k]) : sum;
+                        }
+                    }
+                }
+            }
+            std::swap(x, y);
+        }
+        return x;
+    }
+
+    // power spectrum of a windowed frame of frameSize samples into N_fft bins
+    // buf and tmp are scratch space of frameSize / 2 elements
+    void power(const float* frame, cfloat* buf, cfloat* tmp, float* out) const {
+        constexpr size_t half = frameSize / 2;
+        for (size_t i = 0; i < half; ++i) {
+            buf[i] = cfloat(frame[2 * i], frame[2 * i + 1]);
+        }
+        const cfloat* z = fft(buf, tmp);
+        for (size_t k = 0; k <= half; ++k) {
+            const cfloat zk = z[k % half];
+            const cfloat zc = std::conj(z[(half - k) % half]);
+            const cfloat even = (zk + zc) * 0.5f;
+            const cfloat d = (zk - zc) * 0.5f;
+            const cfloat odd(d.imag(), -d.real()); // -i * d
+            out[k] = std::norm(even + mul(split[k], odd));
+        }
+    }
+
+    static std::shared_ptr<const Plan> get(int nMel) {
+        static std::mutex mutex;
+        static std::map<int, std::shared_ptr<const Plan>> plans;
+        std::lock_guard lock(mutex);
+        auto& plan = plans[nMel];
+        if (!plan) {
+            plan = std::make_shared<Plan>(nMel);
+        }
+        return plan;
+    }
+};
+
+MelSpectrogram::MelSpectrogram(int nMel)
+    : m_plan(Plan::get(nMel))
+{}
+
+MelSpectrogram::~MelSpectrogram() = default;
+
+int MelSpectrogram::nMel() const noexcept {
+    return m_plan->nMel;
+}
+
+void MelSpectrogram::invalidate() noexcept {
+    m_validBegin = m_validEnd = 0;
+}
+
+void MelSpectrogram::dropFront(size_t samples) noexcept {
+    if (samples == 0) {
+        return;
+    }
+
+    const size_t frames = samples / hop;
+    if (samples % hop || m_validEnd < frames + Reflect_frames) {
+        invalidate();
+        return;
+    }
+
+    const size_t nMel = size_t(m_plan->nMel);
+    m_frames.erase(m_frames.begin(), m_frames.begin() + frames * nMel);
+
+    // the first frames now reflect different samples
+    m_validBegin = Reflect_frames;
+    m_validEnd -= frames;
+}
+
+void MelSpectrogram::compute(std::span<const float> pcm, uint32_t nThreads) {
+    const auto& plan = *m_plan;
+    const size_t nMel = size_t(plan.nMel);
+    const size_t n = pcm.size();
+
+    // the same sizes as whisper.cpp
+    m_nLen = int((n + Pad_samples) / hop);
+    m_nLenOrg = int(1 + (int64_t(n) + int64_t(Reflect) - int64_t(frameSize)) / int64_t(hop));
+
+    // frames which overlap audio (including the reflection), the rest are silence
+    const size_t nAudio = std::min(size_t(m_nLen), (Reflect + n + hop - 1) / hop);
+
+    m_frames.resize(nAudio * nMel);
+
+    m_validEnd = std::min(m_validEnd, nAudio);
+    m_validBegin = std::min(m_validBegin, m_validEnd);
+
+    std::vector<size_t> todo;
+    for (size_t i = 0; i < m_validBegin; ++i) {
+        todo.push_back(i);
+    }
+    for (size_t i = m_validEnd; i < nAudio; ++i) {
+        todo.push_back(i);
+    }
+
+    // padded audio: the reflection of pcm[1, Reflect], pcm, and silence
+    auto sample = [&](size_t i) -> float {
+        if (i < Reflect) {
+            const size_t r = Reflect - i;
+            return r < n ? pcm[r] : 0.f;
+        }
+        i -= Reflect;
+        return i < n ? pcm[i] : 0.f;
+    };
+
+    auto computeFrames = [&](size_t begin, size_t end) {
+        std::vector<float> frameBuf(frameSize);
+        std::vector<cfloat> buf(frameSize / 2), tmp(frameSize / 2);
+        std::vector<float> power(N_fft);
+        for (size_t t = begin; t < end; ++t) {
+            const size_t frame = todo[t];
+            const size_t offset = frame * hop;
+
+            if (offset >= Reflect && offset - Reflect + frameSize <= n) {
+                const float* src = pcm.data() + offset - Reflect;
+                for (size_t j = 0; j < frameSize; ++j) {
+                    frameBuf[j] = plan.window[j] * src[j];
+                }
+            }
+            else {
+                for (size_t j = 0; j < frameSize; ++j) {
+                    frameBuf[j] = plan.window[j] * sample(offset + j);
+                }
+            }
+
+            plan.power(frameBuf.data(), buf.data(), tmp.data(), power.data());
+
+            float* dst = m_frames.data() + frame * nMel;
+            for (size_t m = 0; m < nMel; ++m) {
+                const auto& f = plan.filters[m];
+                double sum = 0;
+                for (size_t k = 0; k < f.weights.size(); ++k) {
+                    sum += power[f.begin + k] * f.weights[k];
+                }
+                dst[m] = float(std::log10(std::max(sum, 1e-10)));
+            }
+        }
+    };
+
+    // threads only pay off for a sizable number of frames
+    constexpr size_t Min_frames_per_thread = 128;
+    const size_t threads = std::max(size_t(1), std::min(size_t(nThreads), todo.size() / Min_frames_per_thread));
+    if (threads == 1) {
+        computeFrames(0, todo.size());
+    }
+    else {
+        std::vector<std::thread> workers;
+        const size_t per = (todo.size() + threads - 1) / threads;
+        for (size_t t = 1; t < threads; ++t) {
+            workers.emplace_back(computeFrames, std::min(todo.size(), t * per), std::min(todo.size(), (t + 1) * per));
+        }
+        computeFrames(0, std::min(todo.size(), per));
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+    m_validBegin = 0;
+    m_validEnd = std::min(stableFrames(n), nAudio);
+
+    // clamp to 8 (log10) below the max and scale, as whisper.cpp does
+    double mmax = nAudio < size_t(m_nLen) ? Log_silence : -1e20;
+    for (auto v : m_frames) {
+        mmax = std::max(mmax, double(v));
+    }
+    mmax -= 8.0;
+
+    const size_t nLen = size_t(m_nLen);
+    m_data.resize(nMel * nLen);
+    auto normalize = [mmax](float v) {
+        if (v < mmax) {
+            v = float(mmax);
+        }
+        return float((v + 4.0) / 4.0);
+    };
+    const float silence = normalize(Log_silence);
+    for (size_t m = 0; m < nMel; ++m) {
+        float* row = m_data.data() + m * nLen;
+        for (size_t i = 0; i < nAudio; ++i) {
+            row[i] = normalize(m_frames[i * nMel + m]);
+        }
+        std::fill(row + nAudio, row + nLen, silence);
+    }
+}
+
+} // namespace ac::whisper
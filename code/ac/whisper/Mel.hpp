@@ -0,0 +1,61 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace ac::whisper {
+
+// log-mel spectrogram front end, equivalent to the one of whisper.cpp
+// The FFT plan, window, and filterbank are computed once per mel count and shared between spectrograms.
+// Computed frames are cached, so audio which grows at the end (as in streaming) only computes the new frames,
+// and the 30s of silence that whisper.cpp appends to the input are filled in without computing them.
+class MelSpectrogram {
+public:
+    static constexpr size_t hop = 160;       // 10ms at 16 kHz
+    static constexpr size_t frameSize = 400; // 25ms at 16 kHz
+
+    explicit MelSpectrogram(int nMel);
+    ~MelSpectrogram();
+
+    MelSpectrogram(const MelSpectrogram&) = delete;
+    MelSpectrogram& operator=(const MelSpectrogram&) = delete;
+
+    // forget the cached frames
+    void invalidate() noexcept;
+
+    // the audio lost samples from its front
+    // cached frames are kept if samples is a multiple of hop
+    void dropFront(size_t samples) noexcept;
+
+    // compute the spectrogram of pcm, reusing the cached frames of the previous call
+    // unless invalidate was called, pcm must start with the audio of the previous call (after dropFront)
+    void compute(std::span<const float> pcm, uint32_t nThreads);
+
+    // spectrogram of the audio and 30s of silence after it in the layout of whisper.cpp: [nMel][nLen]
+    const float* data() const noexcept { return m_data.data(); }
+    int nMel() const noexcept;
+    int nLen() const noexcept { return m_nLen; }
+    int nLenOrg() const noexcept { return m_nLenOrg; } // frames of the audio itself
+
+    struct Plan;
+
+private:
+    std::shared_ptr<const Plan> m_plan;
+
+    std::vector<float> m_frames; // log10 of the frames with audio: [frame][nMel]
+
+    // cached frames which are still valid: [m_validBegin, m_validEnd)
+    size_t m_validBegin = 0;
+    size_t m_validEnd = 0;
+
+    std::vector<float> m_data;
+    int m_nLen = 0;
+    int m_nLenOrg = 0;
+};
+
+} // namespace ac::whisper
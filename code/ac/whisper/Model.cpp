@@ -2,9 +2,21 @@
 // SPDX-License-Identifier: MIT
 //
 #include "Model.hpp"
+#include "MappedFile.hpp"
+#include "Quantize.hpp"
 #include <whisper.h>
 #include <astl/move.hpp>
+#include <astl/throw_stdex.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <random>
 #include <stdexcept>
+#include <vector>
 
 namespace ac::whisper {
 namespace {
@@ -16,18 +28,382 @@ whisper_context_params whisperFromModelParams(const Model::Params& params)
     return whisperParams;
 }
 
+Model::Reader memoryReader(std::span<const uint8_t> data) {
+    auto offset = std::make_shared<size_t>(0);
+    return {
+        .read = [data, offset](void* out, size_t size) {
+            size = std::min(size, data.size() - *offset);
+            std::memcpy(out, data.data() + *offset, size);
+            *offset += size;
+            return size;
+        },
+        .eof = [data, offset]() {
+            return *offset >= data.size();
+        },
+        .size = data.size(),
+    };
 }
 
-Model::Model(const char* pathToBin, Params params)
+// read a mapped file, releasing the pages behind the cursor so that the mapping doesn't add the whole file to the
+// memory of the process on top of the copy that whisper.cpp makes
+Model::Reader mappedReader(std::shared_ptr<MappedFile> file) {
+    constexpr size_t releaseStep = 16 * 1024 * 1024;
+    auto reader = memoryReader(file->data());
+    struct State {
+        uint64_t offset = 0;
+        uint64_t released = 0;
+    };
+    auto state = std::make_shared<State>();
+    reader.read = [file, state, read = astl::move(reader.read)](void* out, size_t size) {
+        auto ret = read(out, size);
+        state->offset += ret;
+        if (state->offset - state->released >= releaseStep) {
+            file->releaseBefore(size_t(state->offset));
+            state->released = state->offset;
+        }
+        return ret;
+    };
+    return reader;
+}
+
+Model::Reader fileReader(const char* path) {
+    std::shared_ptr<FILE> f(std::fopen(path, "rb"), [](FILE* f) {
+        if (f) {
+            std::fclose(f);
+        }
+    });
+    if (!f) {
+        throw_ex{} << "Failed to open " << path;
+    }
+
+    // not ftell, which is limited to 2 GB on windows
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(path, ec);
+
+    return {
+        .read = [f](void* out, size_t size) {
+            return std::fread(out, 1, size, f.get());
+        },
+        .eof = [f]() {
+            return !!std::feof(f.get());
+        },
+        .size = ec ? 0 : uint64_t(size),
+    };
+}
+
+// report whole percents of the data read
+// the last one is reported when the model is ready
+Model::Reader trackProgress(Model::Reader reader, Model::ProgressCb progressCb) {
+    if (!progressCb || !reader.size) {
+        return reader;
+    }
+
+    struct State {
+        uint64_t offset = 0;
+        int lastPercent = -1;
+    };
+    auto state = std::make_shared<State>();
+    const auto size = reader.size;
+
+    return {
+        .read = [read = astl::move(reader.read), progressCb = astl::move(progressCb), state, size](void* out, size_t readSize) {
+            auto ret = read(out, readSize);
+            state->offset += ret;
+
+            int percent = int(std::min<uint64_t>(state->offset * 100 / size, 99));
+            if (percent != state->lastPercent) {
+                state->lastPercent = percent;
+                progressCb(float(percent) / 100);
+            }
+
+            return ret;
+        },
+        .eof = astl::move(reader.eof),
+        .size = size,
+    };
+}
+
+// dataSize is set to the size of the data passed to whisper.cpp (after conversion, if any)
+whisper_context* initFromReader(Model::Reader source, const Model::Params& params, const Model::ProgressCb& progressCb, uint64_t& dataSize) {
+    auto reader = trackProgress(astl::move(source), progressCb);
+    if (!params.weightType.empty()) {
+        reader = quantizingReader(astl::move(reader), params.weightType);
+    }
+
+    struct Context {
+        Model::Reader& reader;
+        uint64_t& bytesRead;
+        std::exception_ptr error;
+    } ctx = {reader, dataSize, {}};
+    dataSize = 0;
+
+    whisper_model_loader loader = {};
+    loader.context = &ctx;
+    loader.read = [](void* pctx, void* output, size_t readSize) -> size_t {
+        auto& ctx = *static_cast<Context*>(pctx);
+        if (ctx.error) {
+            return 0;
+        }
+
+        // don't let exceptions from user code propagate through whisper.cpp
+        try {
+            auto ret = ctx.reader.read(output, readSize);
+            ctx.bytesRead += ret;
+            return ret;
+        }
+        catch (...) {
+            ctx.error = std::current_exception();
+            return 0;
+        }
+    };
+    loader.eof = [](void* pctx) {
+        auto& ctx = *static_cast<Context*>(pctx);
+        if (ctx.error) {
+            return true;
+        }
+        try {
+            return ctx.reader.eof();
+        }
+        catch (...) {
+            ctx.error = std::current_exception();
+            return true;
+        }
+    };
+    loader.close = [](void*) {};
+
+    auto ret = whisper_init_with_params_no_state(&loader, whisperFromModelParams(params));
+
+    if (ctx.error) {
+        if (ret) {
+            whisper_free(ret);
+        }
+        std::rethrow_exception(ctx.error);
+    }
+
+    if (ret && progressCb) {
+        progressCb(1.f);
+    }
+
+    return ret;
+}
+
+// write the model with converted weights to a temporary file first, so that concurrent loads never see a partial one
+void writeConverted(const char* pathToBin, const std::string& outPath, std::string_view weightType, const Model::ProgressCb& progressCb) {
+    auto reader = quantizingReader(trackProgress(fileReader(pathToBin), progressCb), weightType);
+
+    auto tmpPath = outPath + "." + std::to_string(std::random_device{}()) + ".tmp";
+    FILE* f = std::fopen(tmpPath.c_str(), "wb");
+    if (!f) {
+        throw_ex{} << "Failed to create " << tmpPath;
+    }
+
+    try {
+        std::vector<uint8_t> buf(1024 * 1024);
+        while (auto size = reader.read(buf.data(), buf.size())) {
+            if (std::fwrite(buf.data(), 1, size, f) != size) {
+                throw_ex{} << "Failed to write " << tmpPath;
+            }
+        }
+        auto closed = std::fclose(f);
+        f = nullptr;
+        if (closed != 0) {
+            throw_ex{} << "Failed to write " << tmpPath;
+        }
+
+        std::error_code ec;
+        std::filesystem::rename(tmpPath, outPath, ec);
+        if (ec) {
+            throw_ex{} << "Failed to create " << outPath << ": " << ec.message();
+        }
+    }
+    catch (...) {
+        if (f) {
+            std::fclose(f);
+        }
+        std::remove(tmpPath.c_str());
+        throw;
+    }
+}
+
+// remove the conversions of earlier versions of the source of cachePath
+// they share its name up to the key of the version: model.q8_0-<path key>-
+void removeStaleConversions(const std::filesystem::path& cachePath) {
+    const auto name = cachePath.filename().string();
+    const auto ext = cachePath.extension().string();
+    const auto prefix = name.substr(0, name.rfind('-') + 1);
+
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(cachePath.parent_path(), ec)) {
+        auto other = entry.path().filename().string();
+        // temporary files may be conversions in progress
+        if (other != name && other.starts_with(prefix) && other.ends_with(ext) && !other.ends_with(".tmp")) {
+            std::filesystem::remove(entry.path(), ec);
+        }
+    }
+}
+
+// load the converted model from the cache, writing it first if it isn't there
+// conversion is skipped entirely on later loads and the cached model is always read through a mapping
+whisper_context* initFromCachedWeights(const char* pathToBin, const Model::Params& params, const Model::ProgressCb& progressCb, uint64_t& dataSize) {
+    auto cachePath = Model::cachedWeightsPath(pathToBin, params);
+
+    // conversion and loading get half of the progress each
+    Model::ProgressCb loadProgress = progressCb;
+    if (!std::filesystem::exists(cachePath)) {
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(cachePath).parent_path(), ec);
+
+        Model::ProgressCb convertProgress;
+        if (progressCb) {
+            convertProgress = [&](float p) { progressCb(p / 2); };
+            loadProgress = [&](float p) { progressCb(0.5f + p / 2); };
+        }
+        writeConverted(pathToBin, cachePath, params.weightType, convertProgress);
+        removeStaleConversions(cachePath);
+    }
+
+    auto file = std::make_shared<MappedFile>(cachePath.c_str());
+    file->adviseSequential();
+    auto cacheParams = params;
+    cacheParams.weightType.clear();
+    return initFromReader(mappedReader(astl::move(file)), cacheParams, loadProgress, dataSize);
+}
+
+// 64-bit FNV-1a
+uint64_t hashBytes(const void* data, size_t size, uint64_t h = 0xcbf29ce484222325ull) {
+    auto bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        h = (h ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+whisper_context* initFromFile(const char* pathToBin, const Model::Params& params, const Model::ProgressCb& progressCb, uint64_t& dataSize) {
+    if (!params.weightType.empty() && params.cacheWeights) {
+        return initFromCachedWeights(pathToBin, params, progressCb, dataSize);
+    }
+
+    if (!params.mmap) {
+        return initFromReader(fileReader(pathToBin), params, progressCb, dataSize);
+    }
+
+    // whisper.cpp allocates the tensors in its own backend buffers, so they can't reference the mapping directly
+    // reading from the page cache spares us the stdio buffering, and the pages which were copied are released as we
+    // go, so the mapping doesn't raise the peak memory of the load
+    auto file = std::make_shared<MappedFile>(pathToBin);
+    file->adviseSequential();
+    return initFromReader(mappedReader(astl::move(file)), params, progressCb, dataSize);
+}
+
+}
+
+Model::Model(const char* pathToBin, Params params, ProgressCb progressCb)
+    : m_params(astl::move(params))
+    , m_ctx(initFromFile(pathToBin, m_params, progressCb, m_dataSize), whisper_free)
+{
+    if (!m_ctx) {
+        throw std::runtime_error("Failed to load model");
+    }
+}
+
+Model::Model(std::span<const uint8_t> data, Params params, ProgressCb progressCb)
+    : m_params(astl::move(params))
+    , m_ctx(initFromReader(memoryReader(data), m_params, progressCb, m_dataSize), whisper_free)
+{
+    if (!m_ctx) {
+        throw std::runtime_error("Failed to load model");
+    }
+}
+
+Model::Model(Reader reader, Params params, ProgressCb progressCb)
     : m_params(astl::move(params))
-    , m_ctx(whisper_init_from_file_with_params_no_state(pathToBin, whisperFromModelParams(m_params)), whisper_free)
+    , m_ctx(initFromReader(astl::move(reader), m_params, progressCb, m_dataSize), whisper_free)
 {
     if (!m_ctx) {
         throw std::runtime_error("Failed to load model");
     }
 }
 
-Model::~Model() = default;
+Model::~Model() {
+    for (auto state : m_idleStates) {
+        whisper_free_state(state);
+    }
+}
+
+Model::StatePtr Model::acquireState() {
+    {
+        std::lock_guard lock(m_statesMutex);
+        if (!m_idleStates.empty()) {
+            auto state = m_idleStates.back();
+            m_idleStates.pop_back();
+            return StatePtr(state, {this});
+        }
+    }
+
+    auto state = whisper_init_state(m_ctx.get());
+    if (!state) {
+        throw_ex{} << "Failed to allocate inference state";
+    }
+    return StatePtr(state, {this});
+}
+
+void Model::releaseState(whisper_state* state) noexcept {
+    if (!state) {
+        return;
+    }
+    {
+        std::lock_guard lock(m_statesMutex);
+        if (m_idleStates.size() < m_params.maxIdleStates) {
+            m_idleStates.push_back(state);
+            return;
+        }
+    }
+    whisper_free_state(state);
+}
+
+size_t Model::numIdleStates() const {
+    std::lock_guard lock(m_statesMutex);
+    return m_idleStates.size();
+}
+
+std::string Model::cachedWeightsPath(const char* pathToBin, const Params& params) {
+    std::string type(params.weightType);
+    std::transform(type.begin(), type.end(), type.begin(), [](char c) { return char(std::tolower(uint8_t(c))); });
+
+    std::filesystem::path source(pathToBin);
+    std::error_code sizeEc, timeEc;
+    const auto size = std::filesystem::file_size(source, sizeEc);
+    const auto mtime = std::filesystem::last_write_time(source, timeEc);
+    if (sizeEc || timeEc) {
+        throw_ex{} << "Failed to open " << pathToBin;
+    }
+    std::error_code ec;
+    auto canonical = std::filesystem::weakly_canonical(source, ec);
+    const auto sourcePath = (ec ? source : canonical).string();
+
+    // the source is identified by its path and its version by its size and modification time, so that looking up
+    // the cache doesn't read the source. a replaced source gets a new key
+    const uint64_t pathKey = hashBytes(sourcePath.data(), sourcePath.size());
+    const uint64_t version[] = {size, uint64_t(mtime.time_since_epoch().count()), quantizerVersion()};
+    const uint64_t versionKey = hashBytes(version, sizeof(version));
+
+    char key[34];
+    std::snprintf(key, sizeof(key), "%016llx-%016llx", (unsigned long long)pathKey, (unsigned long long)versionKey);
+
+    // model.bin -> model.q8_0-<path key>-<version key>.bin
+    auto path = params.cacheDir.empty() ? source.parent_path() : std::filesystem::path(params.cacheDir);
+    path /= source.stem();
+    path += "." + type + "-" + key;
+    path += source.extension();
+    return path.string();
+}
+
+std::string_view Model::tokenText(int32_t token) const noexcept {
+    if (token < 0 || token >= whisper_n_vocab(m_ctx.get())) {
+        return {};
+    }
+    return whisper_token_to_str(m_ctx.get(), token);
+}
 
 
 } // namespace ac::whisper
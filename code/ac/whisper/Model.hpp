@@ -6,9 +6,17 @@
 
 #include <astl/mem_ext.hpp>
 
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
+#include <string_view>
+#include <vector>
 
 struct whisper_context;
+struct whisper_state;
 
 namespace ac::whisper {
 class Job;
@@ -17,17 +25,70 @@ class AC_WHISPER_EXPORT Model {
 public:
     struct Params {
         bool gpu = true; // try to load data on gpu
+        bool mmap = false; // read the model file through a memory mapping (the data is still copied to whisper's buffers)
+        uint32_t maxIdleStates = 2; // released inference states to keep for reuse
+
+        // convert the f32 or f16 weights of the model to this type on load ("f16", "q8_0", "q5_1", "q4_k", ...)
+        // trades accuracy for speed and memory. empty - keep the type of the model data
+        std::string weightType;
+
+        // when loading a file with a weightType, write the converted model to cacheDir and load that the next time
+        // cached models are keyed by the path, size, and modification time of the source, the type, and the version
+        // of the conversion. conversions of earlier versions of the source are removed
+        bool cacheWeights = false;
+        std::string cacheDir; // empty - the directory of the source
     };
 
-    Model(const char* pathToBin, Params params);
+    // called with values in [0, 1] as the model data is read
+    using ProgressCb = std::function<void(float)>;
+
+    // custom source of model data
+    struct Reader {
+        std::function<size_t(void* out, size_t size)> read; // return the number of bytes read
+        std::function<bool()> eof;
+        uint64_t size = 0; // total size of the data, used for progress (0 - unknown)
+    };
+
+    Model(const char* pathToBin, Params params, ProgressCb progressCb = {});
+    Model(std::span<const uint8_t> data, Params params, ProgressCb progressCb = {});
+    Model(Reader reader, Params params, ProgressCb progressCb = {});
     ~Model();
 
     const Params& params() const noexcept { return m_params; }
 
+    // path of the converted model written by cacheWeights
+    static std::string cachedWeightsPath(const char* pathToBin, const Params& params);
+
+    // size of the model data which was loaded (after conversion, if any)
+    uint64_t dataSize() const noexcept { return m_dataSize; }
+
     whisper_context* context() const noexcept { return m_ctx.get(); }
 
+    // text of a token from the model vocabulary
+    std::string_view tokenText(int32_t token) const noexcept;
+
+    // inference states (with their kv caches and compute buffers) are expensive to allocate,
+    // so released ones are kept for reuse, up to maxIdleStates
+    // a recycled state may hold the text context of its previous user
+    struct StateDeleter {
+        Model* model;
+        void operator()(whisper_state* state) const noexcept { model->releaseState(state); }
+    };
+    using StatePtr = std::unique_ptr<whisper_state, StateDeleter>;
+
+    // returns an idle state if there is one, otherwise allocates a new one. thread safe
+    StatePtr acquireState();
+
+    size_t numIdleStates() const;
+
 private:
+    void releaseState(whisper_state* state) noexcept;
+
     const Params m_params;
+    uint64_t m_dataSize = 0; // set while m_ctx is initialized
     astl::c_unique_ptr<whisper_context> m_ctx;
+
+    mutable std::mutex m_statesMutex;
+    std::vector<whisper_state*> m_idleStates;
 };
 } // namespace ac::whisper
@@ -0,0 +1,157 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "Pcm.hpp"
+
+#include <astl/throw_stdex.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+#include <numeric>
+#include <type_traits>
+
+namespace ac::whisper {
+
+namespace {
+
+// the inner loops work on fixed blocks of this many floats so that the compiler can vectorize them
+constexpr size_t Lanes = 8;
+
+constexpr uint64_t Max_phases = 1024;     // phases of the polyphase filter for non-simple rate ratios
+constexpr double Zero_crossings = 16;     // zero crossings of the sinc on each side
+constexpr double Rolloff = 0.945;         // cutoff relative to the lower of the two nyquist frequencies
+
+template <typename T>
+std::vector<float> downmix(std::span<const T> pcm, uint32_t channels) {
+    constexpr float sampleScale = std::is_same_v<T, int16_t> ? 1.f / 32768 : 1.f;
+    const float scale = sampleScale / float(channels);
+
+    const size_t frames = pcm.size() / channels;
+    std::vector<float> ret(frames);
+
+    if (channels == 1) {
+        for (size_t i = 0; i < frames; ++i) {
+            ret[i] = float(pcm[i]) * scale;
+        }
+        return ret;
+    }
+
+    if (channels == 2) {
+        for (size_t i = 0; i < frames; ++i) {
+            ret[i] = (float(pcm[2 * i]) + float(pcm[2 * i + 1])) * scale;
+        }
+        return ret;
+    }
+
+    for (size_t i = 0; i < frames; ++i) {
+        const T* frame = pcm.data() + i * channels;
+        float sum = 0;
+        for (uint32_t c = 0; c < channels; ++c) {
+            sum += float(frame[c]);
+        }
+        ret[i] = sum * scale;
+    }
+    return ret;
+}
+
+float dot(const float* a, const float* b, size_t n) {
+    // n is a multiple of Lanes
+    float acc[Lanes] = {};
+    for (size_t i = 0; i < n; i += Lanes) {
+        for (size_t j = 0; j < Lanes; ++j) {
+            acc[j] += a[i + j] * b[i + j];
+        }
+    }
+    float sum = 0;
+    for (auto v : acc) {
+        sum += v;
+    }
+    return sum;
+}
+
+std::vector<float> resample(std::vector<float> in, uint32_t inRate) {
+    if (inRate == Pcm_sampleRate || in.empty()) {
+        return in;
+    }
+
+    // output sample n is at input position n * m / l
+    const uint64_t g = std::gcd(inRate, Pcm_sampleRate);
+    const uint64_t l = Pcm_sampleRate / g;
+    const uint64_t m = inRate / g;
+
+    // cutoff in cycles per input sample
+    const double fc = 0.5 * std::min(1.0, double(l) / double(m)) * Rolloff;
+    const double halfWidth = Zero_crossings / (2 * fc);
+    const size_t half = size_t(std::ceil(halfWidth));
+    const size_t taps = (2 * half + Lanes - 1) / Lanes * Lanes;
+
+    // filter of phase p is applied to the input samples [base - half + 1, base - half + taps]
+    // where base is the input sample at or before the output position and p is the fractional part of the position
+    const uint64_t phases = std::min(l, Max_phases);
+    std::vector<float> filter(phases * taps, 0.f);
+    for (uint64_t p = 0; p < phases; ++p) {
+        const double frac = double(p) / double(phases);
+        float* h = filter.data() + p * taps;
+        double sum = 0;
+        for (size_t k = 0; k < 2 * half; ++k) {
+            const double x = double(k) - double(half) + 1 - frac;
+            if (std::abs(x) >= halfWidth) {
+                continue;
+            }
+            const double arg = 2 * fc * x;
+            const double sinc = arg == 0 ? 1 : std::sin(std::numbers::pi * arg) / (std::numbers::pi * arg);
+            // blackman window
+            const double w = 0.42 + 0.5 * std::cos(std::numbers::pi * x / halfWidth)
+                + 0.08 * std::cos(2 * std::numbers::pi * x / halfWidth);
+            const double v = sinc * w;
+            h[k] = float(v);
+            sum += v;
+        }
+        // unity gain at dc
+        for (size_t k = 0; k < taps; ++k) {
+            h[k] = float(h[k] / sum);
+        }
+    }
+
+    // pad the input so that the filter never reads out of bounds
+    std::vector<float> padded(half + in.size() + taps, 0.f);
+    std::copy(in.begin(), in.end(), padded.begin() + half);
+
+    const size_t outSize = size_t((uint64_t(in.size()) * l + m - 1) / m);
+    std::vector<float> out(outSize);
+    for (size_t n = 0; n < outSize; ++n) {
+        const uint64_t pos = uint64_t(n) * m;
+        const uint64_t base = pos / l;
+        const uint64_t phase = (pos % l) * phases / l;
+        // input sample base - half + 1 is at padded index base + 1
+        out[n] = dot(padded.data() + base + 1, filter.data() + phase * taps, taps);
+    }
+    return out;
+}
+
+template <typename T>
+std::vector<float> convert(std::span<const T> pcm, PcmFormat format) {
+    if (format.channels == 0) {
+        throw_ex{} << "whisper: invalid channel count: 0";
+    }
+    if (format.sampleRate == 0) {
+        throw_ex{} << "whisper: invalid sample rate: 0";
+    }
+    if (pcm.size() % format.channels) {
+        throw_ex{} << "whisper: " << pcm.size() << " samples are not a whole number of " << format.channels << "-channel frames";
+    }
+    return resample(downmix(pcm, format.channels), format.sampleRate);
+}
+
+} // namespace
+
+std::vector<float> toWhisperPcm(std::span<const float> pcm, PcmFormat format) {
+    return convert(pcm, format);
+}
+
+std::vector<float> toWhisperPcm(std::span<const int16_t> pcm, PcmFormat format) {
+    return convert(pcm, format);
+}
+
+} // namespace ac::whisper
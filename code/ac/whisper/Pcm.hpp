@@ -0,0 +1,27 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace ac::whisper {
+
+// whisper works on 16 kHz mono float32 audio
+constexpr uint32_t Pcm_sampleRate = 16000;
+
+struct PcmFormat {
+    uint32_t sampleRate = Pcm_sampleRate;
+    uint32_t channels = 1; // samples of multiple channels are interleaved
+};
+
+// convert audio to 16 kHz mono float32
+// channels are averaged, int16 samples are scaled to [-1, 1), and other sample rates are resampled with a
+// windowed-sinc low-pass filter
+AC_WHISPER_EXPORT std::vector<float> toWhisperPcm(std::span<const float> pcm, PcmFormat format);
+AC_WHISPER_EXPORT std::vector<float> toWhisperPcm(std::span<const int16_t> pcm, PcmFormat format = {});
+
+} // namespace ac::whisper
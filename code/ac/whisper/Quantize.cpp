@@ -0,0 +1,314 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "Quantize.hpp"
+#include <ggml.h>
+#include <astl/move.hpp>
+#include <astl/throw_stdex.hpp>
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ac::whisper {
+
+namespace {
+
+struct WeightType {
+    ggml_type type;
+    ggml_ftype ftype;
+};
+
+// the types whisper.cpp can load weights of
+constexpr WeightType Supported_weightTypes[] = {
+    {GGML_TYPE_F16, GGML_FTYPE_MOSTLY_F16},
+    {GGML_TYPE_Q4_0, GGML_FTYPE_MOSTLY_Q4_0},
+    {GGML_TYPE_Q4_1, GGML_FTYPE_MOSTLY_Q4_1},
+    {GGML_TYPE_Q5_0, GGML_FTYPE_MOSTLY_Q5_0},
+    {GGML_TYPE_Q5_1, GGML_FTYPE_MOSTLY_Q5_1},
+    {GGML_TYPE_Q8_0, GGML_FTYPE_MOSTLY_Q8_0},
+    {GGML_TYPE_Q2_K, GGML_FTYPE_MOSTLY_Q2_K},
+    {GGML_TYPE_Q3_K, GGML_FTYPE_MOSTLY_Q3_K},
+    {GGML_TYPE_Q4_K, GGML_FTYPE_MOSTLY_Q4_K},
+    {GGML_TYPE_Q5_K, GGML_FTYPE_MOSTLY_Q5_K},
+    {GGML_TYPE_Q6_K, GGML_FTYPE_MOSTLY_Q6_K},
+};
+
+WeightType WeightType_fromName(std::string_view name) {
+    auto iequal = [](std::string_view a, std::string_view b) {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+            return std::tolower(uint8_t(x)) == std::tolower(uint8_t(y));
+        });
+    };
+    for (auto& wt : Supported_weightTypes) {
+        if (iequal(name, ggml_type_name(wt.type))) {
+            return wt;
+        }
+    }
+    throw_ex{} << "Unsupported weight type: " << name;
+}
+
+// 2d tensors which whisper.cpp keeps in f32 regardless of the model type
+constexpr std::string_view Unconverted_tensors[] = {
+    "encoder.conv1.bias",
+    "encoder.conv2.bias",
+    "encoder.positional_embedding",
+    "decoder.positional_embedding",
+};
+
+// bump when the output of the conversion changes
+constexpr uint32_t Quantizer_version = 2;
+
+constexpr uint32_t Ggml_magic = 0x67676d6c; // "ggml"
+constexpr size_t Chunk_size = 1024 * 1024; // approximate size of the pieces in which tensor data is processed
+
+class Quantizer {
+public:
+    Quantizer(Model::Reader source, WeightType target)
+        : m_source(astl::move(source))
+        , m_target(target)
+    {}
+
+    size_t read(void* out, size_t size) {
+        auto dst = static_cast<uint8_t*>(out);
+        size_t ret = 0;
+        while (ret < size) {
+            if (m_pos == m_buf.size()) {
+                m_buf.clear();
+                m_pos = 0;
+                if (!fill()) {
+                    break;
+                }
+            }
+            auto n = std::min(size - ret, m_buf.size() - m_pos);
+            std::memcpy(dst + ret, m_buf.data() + m_pos, n);
+            m_pos += n;
+            ret += n;
+        }
+        return ret;
+    }
+
+    bool eof() const {
+        return m_done && m_pos == m_buf.size();
+    }
+
+private:
+    // produce the next piece of output in m_buf. returns false at the end of the data
+    bool fill() {
+        if (m_done) {
+            return false;
+        }
+        if (!m_headerDone) {
+            convertHeader();
+            m_headerDone = true;
+            return true;
+        }
+        if (m_rowsLeft) {
+            convertRows();
+            return true;
+        }
+        if (m_bytesLeft) {
+            auto n = size_t(std::min<uint64_t>(m_bytesLeft, Chunk_size));
+            readSource(put(n), n);
+            m_bytesLeft -= n;
+            return true;
+        }
+        if (!nextTensor()) {
+            m_done = true;
+            return false;
+        }
+        return true;
+    }
+
+    void readSource(void* out, size_t size) {
+        if (m_source.read(out, size) != size) {
+            throw_ex{} << "Unexpected end of model data";
+        }
+    }
+
+    template <typename T>
+    T readValue() {
+        T ret;
+        readSource(&ret, sizeof(T));
+        return ret;
+    }
+
+    uint8_t* put(size_t size) {
+        auto offset = m_buf.size();
+        m_buf.resize(offset + size);
+        return m_buf.data() + offset;
+    }
+
+    template <typename T>
+    void putValue(const T& value) {
+        std::memcpy(put(sizeof(T)), &value, sizeof(T));
+    }
+
+    void copy(size_t size) {
+        readSource(put(size), size);
+    }
+
+    // magic, hyperparameters, mel filters, and vocabulary
+    void convertHeader() {
+        if (readValue<uint32_t>() != Ggml_magic) {
+            throw_ex{} << "Invalid model data";
+        }
+        putValue(Ggml_magic);
+
+        // n_vocab, n_audio_ctx, n_audio_state, n_audio_head, n_audio_layer,
+        // n_text_ctx, n_text_state, n_text_head, n_text_layer, n_mels
+        copy(10 * sizeof(int32_t));
+
+        auto ftype = readValue<int32_t>() % GGML_QNT_VERSION_FACTOR;
+        if (ftype != GGML_FTYPE_ALL_F32 && ftype != GGML_FTYPE_MOSTLY_F16) {
+            throw_ex{} << "Only f32 and f16 models can be quantized";
+        }
+        putValue(int32_t(GGML_QNT_VERSION * GGML_QNT_VERSION_FACTOR + m_target.ftype));
+
+        auto nMel = readValue<int32_t>();
+        auto nFft = readValue<int32_t>();
+        putValue(nMel);
+        putValue(nFft);
+        copy(size_t(nMel) * nFft * sizeof(float));
+
+        auto nVocab = readValue<int32_t>();
+        putValue(nVocab);
+        for (int32_t i = 0; i < nVocab; ++i) {
+            auto len = readValue<uint32_t>();
+            putValue(len);
+            copy(len);
+        }
+    }
+
+    // the header of the next tensor. returns false at the end of the data
+    bool nextTensor() {
+        int32_t nDims;
+        if (m_source.read(&nDims, sizeof(nDims)) != sizeof(nDims)) {
+            if (m_source.eof()) {
+                return false;
+            }
+            throw_ex{} << "Unexpected end of model data";
+        }
+        auto nameLen = readValue<int32_t>();
+        auto ttype = ggml_type(readValue<int32_t>());
+
+        if (nDims < 1 || nDims > 4 || nameLen < 0 || ttype < 0 || ttype >= GGML_TYPE_COUNT) {
+            throw_ex{} << "Invalid tensor in model data";
+        }
+
+        std::array<int32_t, 4> ne = {1, 1, 1, 1};
+        for (int32_t i = 0; i < nDims; ++i) {
+            ne[i] = readValue<int32_t>();
+        }
+        std::string name(size_t(nameLen), '\0');
+        readSource(name.data(), name.size());
+
+        const uint64_t nelements = uint64_t(ne[0]) * ne[1] * ne[2] * ne[3];
+
+        // whisper.cpp expects the 2d weights in the type of the model and the 3d conv weights in f16 unless the
+        // model is f32. the target type is never f32, so conv weights of f32 models are converted to f16
+        ggml_type dstType = ttype;
+        if (nDims == 2
+            && (ttype == GGML_TYPE_F32 || ttype == GGML_TYPE_F16)
+            && std::find(std::begin(Unconverted_tensors), std::end(Unconverted_tensors), name) == std::end(Unconverted_tensors)
+        ) {
+            dstType = m_target.type;
+        }
+        else if (nDims == 3 && ttype == GGML_TYPE_F32) {
+            dstType = GGML_TYPE_F16;
+        }
+        const bool convert = dstType != ttype;
+
+        if (convert && ne[0] % ggml_blck_size(dstType) != 0) {
+            throw_ex{} << "Tensor " << name << " with rows of " << ne[0] << " can't be converted to "
+                << ggml_type_name(dstType);
+        }
+
+        putValue(nDims);
+        putValue(nameLen);
+        putValue(int32_t(dstType));
+        std::memcpy(put(nDims * sizeof(int32_t)), ne.data(), nDims * sizeof(int32_t));
+        std::memcpy(put(name.size()), name.data(), name.size());
+
+        if (convert) {
+            m_srcType = ttype;
+            m_dstType = dstType;
+            m_rowLen = ne[0];
+            m_rowsLeft = int64_t(ne[1]) * ne[2];
+        }
+        else {
+            m_bytesLeft = nelements * ggml_type_size(ttype) / ggml_blck_size(ttype);
+        }
+        return true;
+    }
+
+    void convertRows() {
+        const auto rows = std::min(m_rowsLeft, std::max<int64_t>(1, Chunk_size / sizeof(float) / m_rowLen));
+        const auto count = size_t(rows * m_rowLen);
+
+        m_src.resize(count * ggml_type_size(m_srcType));
+        readSource(m_src.data(), m_src.size());
+
+        m_f32.resize(count);
+        if (m_srcType == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row(reinterpret_cast<const ggml_fp16_t*>(m_src.data()), m_f32.data(), int64_t(count));
+        }
+        else {
+            std::memcpy(m_f32.data(), m_src.data(), m_src.size());
+        }
+
+        auto dst = put(rows * ggml_row_size(m_dstType, m_rowLen));
+        if (m_dstType == GGML_TYPE_F16) {
+            ggml_fp32_to_fp16_row(m_f32.data(), reinterpret_cast<ggml_fp16_t*>(dst), int64_t(count));
+        }
+        else {
+            ggml_quantize_chunk(m_dstType, m_f32.data(), dst, 0, rows, m_rowLen, nullptr);
+        }
+
+        m_rowsLeft -= rows;
+    }
+
+    Model::Reader m_source;
+    const WeightType m_target;
+
+    std::vector<uint8_t> m_buf; // output which hasn't been read yet
+    size_t m_pos = 0; // read position in m_buf
+
+    bool m_headerDone = false;
+    bool m_done = false;
+
+    // tensor being converted
+    ggml_type m_srcType = GGML_TYPE_F32;
+    ggml_type m_dstType = GGML_TYPE_F16;
+    int64_t m_rowLen = 0;
+    int64_t m_rowsLeft = 0;
+    std::vector<uint8_t> m_src;
+    std::vector<float> m_f32;
+
+    // bytes of tensor data to pass through
+    uint64_t m_bytesLeft = 0;
+};
+
+} // namespace
+
+Model::Reader quantizingReader(Model::Reader source, std::string_view weightType) {
+    auto q = std::make_shared<Quantizer>(astl::move(source), WeightType_fromName(weightType));
+    return {
+        .read = [q](void* out, size_t size) {
+            return q->read(out, size);
+        },
+        .eof = [q]() {
+            return q->eof();
+        },
+        .size = 0, // progress is tracked on the source
+    };
+}
+
+uint32_t quantizerVersion() {
+    return GGML_QNT_VERSION * 1000 + Quantizer_version;
+}
+
+} // namespace ac::whisper
@@ -0,0 +1,21 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "Model.hpp"
+
+#include <cstdint>
+#include <string_view>
+
+namespace ac::whisper {
+
+// converts the weights of ggml whisper model data to another type ("f16", "q8_0", "q5_1", "q4_k", ...) as it is read
+// like whisper.cpp's quantize tool, only the 2d weight matrices are converted, except for the 3d conv weights of f32
+// models, which are converted to f16 as whisper.cpp expects them. the rest is passed through
+// throws on unsupported types. reading throws if the source is not an f32 or f16 model
+Model::Reader quantizingReader(Model::Reader source, std::string_view weightType);
+
+// changes whenever quantizingReader produces different data for the same source and type
+uint32_t quantizerVersion();
+
+} // namespace ac::whisper
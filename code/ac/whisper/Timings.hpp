@@ -0,0 +1,39 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include <cstdint>
+
+namespace ac::whisper {
+
+// Where the time of a transcription was spent
+struct Timings {
+    double melMs = 0;    // log-mel spectrogram
+    double encodeMs = 0; // encoder passes (including the processing of the prompt)
+    double decodeMs = 0; // token decoding and sampling
+    double totalMs = 0;
+
+    double firstSegmentMs = -1; // from the start to the first produced segment (-1 if there were none)
+
+    uint32_t runs = 0;           // number of inference runs
+    uint32_t encoderPasses = 0;  // number of 30s (or audio_ctx) windows encoded
+    uint64_t audioSamples = 0;   // processed audio
+
+    // accumulate
+    // firstSegmentMs is kept from the first run which produced a segment
+    Timings& operator+=(const Timings& other) {
+        melMs += other.melMs;
+        encodeMs += other.encodeMs;
+        decodeMs += other.decodeMs;
+        totalMs += other.totalMs;
+        if (firstSegmentMs < 0) {
+            firstSegmentMs = other.firstSegmentMs;
+        }
+        runs += other.runs;
+        encoderPasses += other.encoderPasses;
+        audioSamples += other.audioSamples;
+        return *this;
+    }
+};
+
+} // namespace ac::whisper
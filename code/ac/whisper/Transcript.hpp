@@ -0,0 +1,59 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "Timings.hpp"
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ac::whisper {
+
+// Result of a transcription
+// All segments share a single text buffer and a single token array. Segments reference them with offsets.
+struct Transcript {
+    struct Token {
+        int32_t id = 0;
+        float p = 0;    // probability
+        float plog = 0; // log probability
+        int64_t t0 = -1; // start in ms (-1 if token timestamps are not enabled)
+        int64_t t1 = -1; // end in ms (-1 if token timestamps are not enabled)
+    };
+
+    struct Segment {
+        int64_t t0 = 0; // start in ms
+        int64_t t1 = 0; // end in ms
+        float noSpeechProb = 0;
+
+        uint32_t textOffset = 0;
+        uint32_t textLength = 0;
+
+        uint32_t tokenOffset = 0;
+        uint32_t tokenCount = 0;
+    };
+
+    // texts of all segments, each followed by a new line
+    std::string text;
+
+    // text tokens of all segments (special tokens are omitted)
+    std::vector<Token> tokens;
+
+    std::vector<Segment> segments;
+
+    std::string language; // detected or specified language
+
+    Timings timings;
+
+    std::string_view segmentText(const Segment& s) const {
+        return std::string_view(text).substr(s.textOffset, s.textLength);
+    }
+
+    std::span<const Token> segmentTokens(const Segment& s) const {
+        return std::span(tokens).subspan(s.tokenOffset, s.tokenCount);
+    }
+};
+
+} // namespace ac::whisper
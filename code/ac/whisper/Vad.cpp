@@ -0,0 +1,85 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "Vad.hpp"
+
+#include <whisper.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace ac::whisper {
+
+std::vector<SpeechRegion> detectSpeech(std::span<const float> pcmf32, const VadParams& params) {
+    const size_t frameSize = std::max(size_t(1), size_t(params.frameMs) * WHISPER_SAMPLE_RATE / 1000);
+    const size_t numFrames = (pcmf32.size() + frameSize - 1) / frameSize;
+
+    if (numFrames == 0) {
+        return {};
+    }
+
+    std::vector<float> energy(numFrames);
+    for (size_t i = 0; i < numFrames; ++i) {
+        auto frame = pcmf32.subspan(i * frameSize, std::min(frameSize, pcmf32.size() - i * frameSize));
+        double sum = 0;
+        for (auto s : frame) {
+            sum += double(s) * s;
+        }
+        energy[i] = float(10 * std::log10(sum / double(frame.size()) + 1e-10));
+    }
+
+    // use a low percentile of the frame energies as the noise floor
+    float noiseFloor;
+    {
+        auto sorted = energy;
+        auto p = sorted.begin() + sorted.size() / 10;
+        std::nth_element(sorted.begin(), p, sorted.end());
+        noiseFloor = *p;
+    }
+
+    // with little or no silence in the input the floor is actually speech, hence the upper limit
+    const float threshold = std::clamp(noiseFloor + params.thresholdDb, params.minEnergyDb, params.maxEnergyDb);
+
+    const size_t minSilenceFrames = params.minSilenceMs / std::max(1u, params.frameMs);
+    const size_t minSpeechFrames = params.minSpeechMs / std::max(1u, params.frameMs);
+
+    // speech regions in frames, merging those separated by short silences
+    std::vector<SpeechRegion> frameRegions;
+    for (size_t i = 0; i < numFrames; ++i) {
+        if (energy[i] < threshold) {
+            continue;
+        }
+        if (!frameRegions.empty() && i - frameRegions.back().end <= minSilenceFrames) {
+            frameRegions.back().end = i + 1;
+        }
+        else {
+            frameRegions.push_back({i, i + 1});
+        }
+    }
+
+    const size_t pad = size_t(params.padMs) * WHISPER_SAMPLE_RATE / 1000;
+
+    std::vector<SpeechRegion> ret;
+    for (auto& fr : frameRegions) {
+        if (fr.end - fr.begin < minSpeechFrames) {
+            continue;
+        }
+
+        SpeechRegion r;
+        r.begin = fr.begin * frameSize;
+        r.begin = r.begin > pad ? r.begin - pad : 0;
+        r.end = std::min(fr.end * frameSize + pad, pcmf32.size());
+
+        // padding may make neighboring regions overlap
+        if (!ret.empty() && r.begin <= ret.back().end) {
+            ret.back().end = r.end;
+        }
+        else {
+            ret.push_back(r);
+        }
+    }
+
+    return ret;
+}
+
+} // namespace ac::whisper
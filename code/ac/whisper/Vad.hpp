@@ -0,0 +1,35 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace ac::whisper {
+
+// Energy based voice activity detection
+// The audio is split into frames and a frame is considered speech if its energy is sufficiently above the
+// estimated noise floor of the input.
+struct VadParams {
+    uint32_t frameMs = 20;
+    float thresholdDb = 12;     // min energy above the noise floor for speech frames
+    float minEnergyDb = -55;    // frames quieter than this (in dBFS) are never speech
+    float maxEnergyDb = -35;    // frames louder than this (in dBFS) are always speech
+    uint32_t minSpeechMs = 150; // shorter speech regions are dropped
+    uint32_t minSilenceMs = 400; // shorter silences between speech regions are not split
+    uint32_t padMs = 200;       // padding added to both sides of speech regions
+};
+
+struct SpeechRegion {
+    size_t begin = 0; // first sample
+    size_t end = 0;   // one past the last sample
+};
+
+// returns the speech regions in the input (sorted and not overlapping)
+AC_WHISPER_EXPORT std::vector<SpeechRegion> detectSpeech(std::span<const float> pcmf32, const VadParams& params);
+
+} // namespace ac::whisper
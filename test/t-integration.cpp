@@ -4,6 +4,7 @@
 #include <ac/whisper/Init.hpp>
 #include <ac/whisper/Model.hpp>
 #include <ac/whisper/Instance.hpp>
+#include <ac/whisper/Batch.hpp>
 
 #include <ac-audio.hpp>
 
@@ -11,6 +12,18 @@
 
 #include "ac-test-data-whisper-dir.h"
 
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cmath>
+#include <numbers>
+#include <thread>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+
 
 struct GlobalFixture {
     GlobalFixture() {
@@ -24,6 +37,43 @@ const char* Base_en_f16 = AC_TEST_DATA_WHISPER_DIR "/whisper-base.en-f16.bin";
 
 #include <iostream>
 
+// lowercase words of a text without punctuation
+std::vector<std::string> words(std::string_view text) {
+    std::vector<std::string> ret;
+    std::string word;
+    for (char c : text) {
+        if (std::isalnum(uint8_t(c)) || c == '\'') {
+            word += char(std::tolower(uint8_t(c)));
+        }
+        else if (!word.empty()) {
+            ret.push_back(std::move(word));
+            word.clear();
+        }
+    }
+    if (!word.empty()) {
+        ret.push_back(std::move(word));
+    }
+    return ret;
+}
+
+// number of sequences of n words which appear more than once
+size_t repeatedNgrams(const std::vector<std::string>& w, size_t n) {
+    std::map<std::vector<std::string>, int> counts;
+    for (size_t i = 0; i + n <= w.size(); ++i) {
+        ++counts[std::vector<std::string>(w.begin() + i, w.begin() + i + n)];
+    }
+    return size_t(std::count_if(counts.begin(), counts.end(), [](auto& c) { return c.second > 1; }));
+}
+
+// number of words of b which are also in a (with multiplicity)
+size_t commonWords(std::vector<std::string> a, std::vector<std::string> b) {
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+    std::vector<std::string> common;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(common));
+    return common.size();
+}
+
 TEST_CASE("inference") {
     ac::whisper::Model model(Base_en_f16, {});
     REQUIRE(!!model.context());
@@ -55,3 +105,734 @@ TEST_CASE("inference") {
 
     }
 }
+
+TEST_CASE("instance params") {
+    ac::whisper::Model model(Base_en_f16, {});
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+
+    CHECK_THROWS_WITH(ac::whisper::Instance(model, {.language = "xx"}), "Unknown language: xx");
+
+    {
+        // by default the result doesn't depend on the previous calls
+        ac::whisper::Instance inst(model, {});
+        auto first = inst.transcribe(pcmf32);
+        inst.transcribe(std::span(pcmf32).first(16000 * 3));
+        CHECK(inst.transcribe(pcmf32) == first);
+    }
+
+    {
+        ac::whisper::Instance inst(model, {.singleSegment = true});
+        auto t = inst.transcribeDetailed(pcmf32);
+        CHECK(t.segments.size() == 1);
+    }
+
+    {
+        // a short clip with the automatic audio context
+        auto clip = std::span(pcmf32).first(16000 * 3);
+        ac::whisper::Instance autoCtx(model, {.autoAudioCtx = true});
+        auto text = autoCtx.transcribe(clip);
+        CHECK(text.find("Yes, I like it.") != std::string::npos);
+    }
+
+    {
+        ac::whisper::Instance inst(model, {.maxLen = 20});
+        auto t = inst.transcribeDetailed(pcmf32);
+        CHECK(t.segments.size() > 4);
+    }
+
+    {
+        ac::whisper::Instance inst(model, {.samplingStrategy = ac::whisper::Instance::InitParams::BEAM_SEARCH, .beamSize = 2});
+        auto t = inst.transcribeDetailed(pcmf32);
+        CHECK(t.text.find("Prentice Hall") != std::string::npos);
+    }
+}
+
+TEST_CASE("timings") {
+    ac::whisper::Model model(Base_en_f16, {});
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+
+    ac::whisper::Instance inst(model, {});
+    CHECK(inst.totalTimings().runs == 0);
+
+    auto t = inst.transcribeDetailed(pcmf32);
+    auto& last = inst.lastTimings();
+    CHECK(last.runs == 1);
+    CHECK(last.encoderPasses == 1);
+    CHECK(last.audioSamples == pcmf32.size());
+    CHECK(last.melMs > 0);
+    CHECK(last.encodeMs > 0);
+    CHECK(last.decodeMs > 0);
+    CHECK(last.firstSegmentMs > last.melMs);
+    CHECK(last.totalMs >= last.melMs + last.encodeMs);
+    CHECK(t.timings.totalMs == last.totalMs);
+
+    inst.transcribe(pcmf32);
+    CHECK(inst.totalTimings().runs == 2);
+    CHECK(inst.totalTimings().audioSamples == 2 * pcmf32.size());
+    CHECK(inst.totalTimings().totalMs == doctest::Approx(t.timings.totalMs + inst.lastTimings().totalMs));
+
+    inst.resetTotalTimings();
+    CHECK(inst.totalTimings().runs == 0);
+}
+
+TEST_CASE("transcript") {
+    ac::whisper::Model model(Base_en_f16, {});
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+
+    ac::whisper::Instance inst(model, {.tokenTimestamps = true});
+    auto t = inst.transcribeDetailed(pcmf32);
+
+    // same text as the plain transcription
+    ac::whisper::Instance plain(model, {});
+    CHECK(t.text == plain.transcribe(pcmf32));
+    CHECK(t.language == "en");
+
+    REQUIRE(t.segments.size() == 4);
+    CHECK(t.segmentText(t.segments[1]) == " Prentice Hall always delivers good seminars.");
+
+    int64_t prevT1 = 0;
+    uint32_t tokenOffset = 0;
+    for (auto& seg : t.segments) {
+        CHECK(seg.t0 >= prevT1);
+        CHECK(seg.t1 > seg.t0);
+        prevT1 = seg.t1;
+
+        CHECK(seg.tokenOffset == tokenOffset);
+        CHECK(seg.tokenCount > 0);
+        tokenOffset += seg.tokenCount;
+
+        std::string tokenText;
+        for (auto& token : t.segmentTokens(seg)) {
+            CHECK(token.p > 0);
+            CHECK(token.p <= 1);
+            CHECK(token.t0 >= seg.t0);
+            CHECK(token.t1 <= seg.t1);
+            tokenText += model.tokenText(token.id);
+        }
+        CHECK(tokenText == t.segmentText(seg));
+    }
+    CHECK(tokenOffset == t.tokens.size());
+}
+
+TEST_CASE("long form") {
+    ac::whisper::Model model(Base_en_f16, {});
+
+    auto prenticeHall = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+    std::vector<float> audio;
+    for (int i = 0; i < 4; ++i) {
+        audio.insert(audio.end(), prenticeHall.begin(), prenticeHall.end());
+        audio.resize(audio.size() + 16000, 0.f);
+    }
+
+    ac::whisper::Batch batch(model, {}, {.maxBatchSize = 2, .nThreads = 4});
+
+    auto count = [](const std::string& text, std::string_view word) {
+        size_t n = 0;
+        for (auto p = text.find(word); p != std::string::npos; p = text.find(word, p + 1)) {
+            ++n;
+        }
+        return n;
+    };
+
+    // cut at silences
+    {
+        auto t = batch.transcribeLong(audio, {.chunkMs = 15000});
+        CHECK(count(t.text, "seminars") == 4);
+        CHECK(count(t.text, "Long Beach") == 4);
+
+        int64_t prevT0 = -1;
+        for (auto& seg : t.segments) {
+            CHECK(seg.t0 > prevT0);
+            prevT0 = seg.t0;
+        }
+        CHECK(prevT0 > int64_t(audio.size() / 16) * 3 / 4);
+    }
+
+    // no silences to cut at: chunks overlap
+    {
+        ac::whisper::VadParams noVad;
+        noVad.maxEnergyDb = noVad.minEnergyDb = -1000;
+        auto t = batch.transcribeLong(audio, {.chunkMs = 10000, .overlapMs = 2000, .vad = noVad});
+        CHECK(t.segments.size() > 8);
+
+        int64_t prevT1 = -1;
+        for (auto& seg : t.segments) {
+            CHECK(seg.t1 > prevT1);
+            prevT1 = seg.t1;
+        }
+    }
+
+    // the overlaps are not transcribed twice
+    {
+        auto asSheSat = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/as-she-sat.wav");
+        std::vector<float> speech = prenticeHall;
+        speech.insert(speech.end(), asSheSat.begin(), asSheSat.end());
+
+        ac::whisper::VadParams noVad;
+        noVad.maxEnergyDb = noVad.minEnergyDb = -1000;
+        auto t = batch.transcribeLong(speech, {.chunkMs = 4000, .overlapMs = 2000, .vad = noVad});
+
+        auto stitched = words(t.text);
+        auto full = words(ac::whisper::Instance(model, {}).transcribe(speech));
+        CHECK(repeatedNgrams(stitched, 3) == 0);
+        CHECK(stitched.size() <= full.size() * 11 / 10);
+        CHECK(commonWords(stitched, full) >= full.size() * 8 / 10);
+
+        for (auto& seg : t.segments) {
+            std::string tokenText;
+            for (auto& token : t.segmentTokens(seg)) {
+                tokenText += model.tokenText(token.id);
+            }
+            CHECK(tokenText == t.segmentText(seg));
+        }
+    }
+}
+
+TEST_CASE("vad") {
+    std::vector<float> silence(16000 * 3, 0.f);
+    CHECK(ac::whisper::detectSpeech(silence, {}).empty());
+    CHECK(ac::whisper::detectSpeech({}, {}).empty());
+
+    auto speech = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/as-she-sat.wav");
+
+    // 3s of silence, the speech, 3s of silence, the speech again
+    std::vector<float> audio = silence;
+    audio.insert(audio.end(), speech.begin(), speech.end());
+    audio.insert(audio.end(), silence.begin(), silence.end());
+    const size_t secondBegin = audio.size();
+    audio.insert(audio.end(), speech.begin(), speech.end());
+
+    auto regions = ac::whisper::detectSpeech(audio, {});
+    REQUIRE(regions.size() >= 2);
+    CHECK(regions.front().begin >= silence.size() - 16000);
+    CHECK(regions.back().end <= audio.size());
+    for (size_t i = 1; i < regions.size(); ++i) {
+        CHECK(regions[i].begin > regions[i - 1].end);
+    }
+
+    ac::whisper::Model model(Base_en_f16, {});
+    ac::whisper::Instance inst(model, {});
+
+    CHECK(inst.transcribeSpeech(silence, {}).segments.empty());
+
+    auto t = inst.transcribeSpeech(audio, {});
+    REQUIRE(t.segments.size() >= 2);
+
+    // timestamps are mapped back to the original audio
+    CHECK(t.segments.front().t0 >= 2000);
+    CHECK(t.segments.back().t1 > int64_t(secondBegin / 16));
+}
+
+TEST_CASE("pcm") {
+    // 1s of a 440 Hz tone at 48 kHz stereo, with a 12 kHz tone which must be filtered out
+    std::vector<int16_t> stereo48k;
+    for (int i = 0; i < 48000; ++i) {
+        const double t = double(i) / 48000;
+        auto v = int16_t(16384 * std::sin(2 * std::numbers::pi * 440 * t) + 8192 * std::sin(2 * std::numbers::pi * 12000 * t));
+        stereo48k.push_back(v);
+        stereo48k.push_back(v);
+    }
+
+    auto mono16k = ac::whisper::toWhisperPcm(stereo48k, {.sampleRate = 48000, .channels = 2});
+    REQUIRE(mono16k.size() == 16000);
+
+    float maxError = 0;
+    for (size_t i = 1000; i < mono16k.size() - 1000; ++i) {
+        const double expected = 0.5 * std::sin(2 * std::numbers::pi * 440 * double(i) / 16000);
+        maxError = std::max(maxError, float(std::abs(mono16k[i] - expected)));
+    }
+    CHECK(maxError < 0.001f);
+
+    CHECK_THROWS(ac::whisper::toWhisperPcm(std::span(stereo48k).first(3), {.channels = 2}));
+
+    // transcription of 16-bit input
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+    std::vector<int16_t> pcms16;
+    for (auto f : pcmf32) {
+        pcms16.push_back(int16_t(std::clamp(f * 32768.f, -32768.f, 32767.f)));
+    }
+
+    ac::whisper::Model model(Base_en_f16, {});
+    ac::whisper::Instance inst(model, {});
+    auto text = inst.transcribe(pcms16);
+    CHECK(text.find("Prentice Hall") != std::string::npos);
+    CHECK(text == inst.transcribe(pcmf32));
+}
+
+TEST_CASE("mel front end") {
+    ac::whisper::Model model(Base_en_f16, {});
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+
+    ac::whisper::Instance own(model, {});
+    ac::whisper::Instance builtin(model, {.melFrontEnd = false});
+
+    // the spectrograms match up to rounding
+    CHECK(own.transcribe(pcmf32) == builtin.transcribe(pcmf32));
+
+    auto clip = std::span(pcmf32).first(16000 * 3);
+    CHECK(own.transcribe(clip) == builtin.transcribe(clip));
+
+    // too short for a frame
+    CHECK(own.transcribe(std::span(pcmf32).first(100)) == "");
+}
+
+TEST_CASE("state pool") {
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+
+    ac::whisper::Model model(Base_en_f16, {.maxIdleStates = 1});
+    CHECK(model.numIdleStates() == 0);
+
+    std::string expected;
+    {
+        ac::whisper::Instance a(model, {});
+        ac::whisper::Instance b(model, {});
+        expected = a.transcribe(pcmf32);
+        b.transcribe(pcmf32);
+    }
+    // only one of the two states is kept
+    CHECK(model.numIdleStates() == 1);
+
+    {
+        ac::whisper::Instance recycled(model, {});
+        CHECK(model.numIdleStates() == 0);
+
+        // the text context of the previous user of the state is not used
+        CHECK(recycled.transcribe(pcmf32) == expected);
+    }
+    CHECK(model.numIdleStates() == 1);
+
+    ac::whisper::Model noPool(Base_en_f16, {.maxIdleStates = 0});
+    {
+        ac::whisper::Instance inst(noPool, {});
+    }
+    CHECK(noPool.numIdleStates() == 0);
+}
+
+TEST_CASE("warmup") {
+    ac::whisper::Model model(Base_en_f16, {});
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+
+    ac::whisper::Instance cold(model, {});
+    auto expected = cold.transcribe(pcmf32);
+
+    for (bool melFrontEnd : {true, false}) {
+        ac::whisper::Instance warm(model, {.melFrontEnd = melFrontEnd});
+        CHECK(warm.warmup() > 0);
+
+        // no effect on results or timings
+        CHECK(warm.totalTimings().runs == 0);
+        CHECK(warm.transcribe(pcmf32) == expected);
+        CHECK(warm.totalTimings().runs == 1);
+    }
+}
+
+TEST_CASE("cancel") {
+    ac::whisper::Model model(Base_en_f16, {});
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+
+    ac::whisper::Instance inst(model, {});
+
+    inst.cancel();
+    CHECK(inst.cancelled());
+    CHECK_THROWS_WITH(inst.transcribe(pcmf32), "Inference cancelled!");
+    inst.resetCancel();
+
+    inst.setDeadline(std::chrono::steady_clock::now() - std::chrono::seconds(1));
+    CHECK_THROWS_WITH(inst.transcribe(pcmf32), "Inference deadline exceeded!");
+    inst.setDeadline({});
+
+    // cancel from another thread while the inference is running
+    std::vector<float> longAudio;
+    for (int i = 0; i < 4; ++i) {
+        longAudio.insert(longAudio.end(), pcmf32.begin(), pcmf32.end());
+    }
+    std::thread canceller([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        inst.cancel();
+    });
+    CHECK_THROWS_WITH(inst.transcribe(longAudio), "Inference cancelled!");
+    canceller.join();
+
+    // the instance is usable after a reset
+    inst.resetCancel();
+    CHECK(inst.transcribe(pcmf32).find("Prentice Hall") != std::string::npos);
+}
+
+TEST_CASE("mmap") {
+    ac::whisper::Model model(Base_en_f16, {.mmap = true});
+    REQUIRE(!!model.context());
+    CHECK(model.params().mmap);
+
+    ac::whisper::Instance inst(model, {});
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+    auto result = inst.transcribe(pcmf32);
+    CHECK(result.find("Prentice Hall always delivers good seminars.") != std::string::npos);
+
+    CHECK_THROWS(ac::whisper::Model(AC_TEST_DATA_WHISPER_DIR "/missing.bin", {.mmap = true}));
+}
+
+TEST_CASE("load from memory") {
+    std::vector<uint8_t> data;
+    {
+        std::ifstream fin(Base_en_f16, std::ios::binary);
+        REQUIRE(fin);
+        data.assign(std::istreambuf_iterator<char>(fin), {});
+    }
+
+    std::vector<float> progress;
+    auto progressCb = [&](float p) { progress.push_back(p); };
+
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+
+    std::string expected;
+    {
+        ac::whisper::Model model(Base_en_f16, {}, progressCb);
+        REQUIRE(progress.size() > 1);
+        CHECK(std::is_sorted(progress.begin(), progress.end()));
+        CHECK(progress.back() == 1.f);
+
+        ac::whisper::Instance inst(model, {});
+        expected = inst.transcribe(pcmf32);
+    }
+
+    {
+        progress.clear();
+        ac::whisper::Model model(std::span<const uint8_t>(data), {}, progressCb);
+        CHECK(progress.size() > 1);
+        CHECK(progress.back() == 1.f);
+
+        ac::whisper::Instance inst(model, {});
+        CHECK(inst.transcribe(pcmf32) == expected);
+    }
+
+    {
+        size_t offset = 0;
+        ac::whisper::Model::Reader reader = {
+            .read = [&](void* out, size_t size) {
+                size = std::min(size, data.size() - offset);
+                memcpy(out, data.data() + offset, size);
+                offset += size;
+                return size;
+            },
+            .eof = [&] { return offset == data.size(); },
+        };
+        ac::whisper::Model model(std::move(reader), {});
+        CHECK(offset == data.size());
+
+        ac::whisper::Instance inst(model, {});
+        CHECK(inst.transcribe(pcmf32) == expected);
+    }
+
+    {
+        ac::whisper::Model::Reader reader = {
+            .read = [](void*, size_t) -> size_t { throw std::runtime_error("read error"); },
+            .eof = [] { return false; },
+        };
+        CHECK_THROWS_WITH(ac::whisper::Model(std::move(reader), {}), "read error");
+    }
+}
+
+// widen the tensors of an f16 model to f32, producing the model as it would be in f32
+float f16ToF32(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0 && mant == 0) {
+        bits = sign;
+    }
+    else if (exp == 0) {
+        // subnormal
+        exp = 127 - 15 + 1;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            --exp;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    else if (exp == 31) {
+        bits = sign | 0x7f800000 | (mant << 13);
+    }
+    else {
+        bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    }
+    return std::bit_cast<float>(bits);
+}
+
+std::vector<uint8_t> loadAsF32Model(const char* path) {
+    std::ifstream fin(path, std::ios::binary);
+    REQUIRE(fin);
+
+    std::vector<uint8_t> out;
+    auto copy = [&](size_t size) {
+        auto offset = out.size();
+        out.resize(offset + size);
+        REQUIRE(fin.read(reinterpret_cast<char*>(out.data() + offset), std::streamsize(size)));
+    };
+    auto readI32 = [&] {
+        int32_t v;
+        REQUIRE(fin.read(reinterpret_cast<char*>(&v), sizeof(v)));
+        return v;
+    };
+    auto putI32 = [&](int32_t v) {
+        auto p = reinterpret_cast<const uint8_t*>(&v);
+        out.insert(out.end(), p, p + sizeof(v));
+    };
+
+    copy(11 * sizeof(int32_t)); // magic and hparams
+    readI32();
+    putI32(0); // ftype: all f32
+
+    auto nMel = readI32();
+    auto nFft = readI32();
+    putI32(nMel);
+    putI32(nFft);
+    copy(size_t(nMel) * nFft * sizeof(float));
+
+    auto nVocab = readI32();
+    putI32(nVocab);
+    for (int32_t i = 0; i < nVocab; ++i) {
+        auto len = readI32();
+        putI32(len);
+        copy(size_t(len));
+    }
+
+    int32_t nDims;
+    while (fin.read(reinterpret_cast<char*>(&nDims), sizeof(nDims))) {
+        auto nameLen = readI32();
+        auto ttype = readI32();
+        REQUIRE((ttype == 0 || ttype == 1));
+        putI32(nDims);
+        putI32(nameLen);
+        putI32(0);
+
+        size_t n = 1;
+        for (int32_t i = 0; i < nDims; ++i) {
+            auto ne = readI32();
+            putI32(ne);
+            n *= size_t(ne);
+        }
+        copy(size_t(nameLen));
+
+        if (ttype == 0) {
+            copy(n * sizeof(float));
+            continue;
+        }
+        std::vector<uint16_t> f16(n);
+        REQUIRE(fin.read(reinterpret_cast<char*>(f16.data()), std::streamsize(n * sizeof(uint16_t))));
+        for (auto h : f16) {
+            auto f = f16ToF32(h);
+            auto p = reinterpret_cast<const uint8_t*>(&f);
+            out.insert(out.end(), p, p + sizeof(f));
+        }
+    }
+
+    return out;
+}
+
+TEST_CASE("quantize on load") {
+    auto pcmf32 = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+
+    for (auto type : {"q8_0", "q5_1"}) {
+        ac::whisper::Model model(Base_en_f16, {.weightType = type});
+        ac::whisper::Instance inst(model, {});
+        CHECK(inst.transcribe(pcmf32).find("Prentice Hall") != std::string::npos);
+    }
+
+    CHECK_THROWS_WITH(ac::whisper::Model(Base_en_f16, {.weightType = "q9_9"}), "Unsupported weight type: q9_9");
+
+    {
+        // the conv weights of f32 models are converted too, as whisper.cpp expects them in f16
+        auto f32Model = loadAsF32Model(Base_en_f16);
+        for (auto type : {"f16", "q8_0"}) {
+            ac::whisper::Model model(std::span<const uint8_t>(f32Model), {.weightType = type});
+            ac::whisper::Instance inst(model, {});
+            CHECK(inst.transcribe(pcmf32).find("Prentice Hall") != std::string::npos);
+        }
+    }
+
+    auto dir = std::filesystem::temp_directory_path() / "ac-whisper-quantize-test";
+    std::filesystem::remove_all(dir);
+    const ac::whisper::Model::Params params = {.weightType = "q8_0", .cacheWeights = true, .cacheDir = dir.string()};
+
+    // keyed by the source and the type
+    auto cached = ac::whisper::Model::cachedWeightsPath(Base_en_f16, params);
+    CHECK(std::filesystem::path(cached).parent_path() == dir);
+    CHECK(std::filesystem::path(cached).filename().string().starts_with("whisper-base.en-f16.q8_0-"));
+    CHECK(ac::whisper::Model::cachedWeightsPath(Base_en_f16, params) == cached);
+    auto q5Params = params;
+    q5Params.weightType = "q5_1";
+    CHECK(ac::whisper::Model::cachedWeightsPath(Base_en_f16, q5Params) != cached);
+
+    std::vector<float> progress;
+    auto progressCb = [&](float p) { progress.push_back(p); };
+
+    std::string expected;
+    {
+        ac::whisper::Model model(Base_en_f16, params, progressCb);
+        CHECK(std::is_sorted(progress.begin(), progress.end()));
+        CHECK(progress.back() == 1.f);
+        REQUIRE(std::filesystem::exists(cached));
+        CHECK(std::filesystem::file_size(cached) < std::filesystem::file_size(Base_en_f16));
+        CHECK(model.dataSize() == std::filesystem::file_size(cached));
+
+        ac::whisper::Instance inst(model, {});
+        expected = inst.transcribe(pcmf32);
+    }
+
+    {
+        // loaded from the cache without converting again
+        auto cachedTime = std::filesystem::last_write_time(cached);
+        ac::whisper::Model model(Base_en_f16, params);
+        CHECK(std::filesystem::last_write_time(cached) == cachedTime);
+
+        ac::whisper::Instance inst(model, {});
+        CHECK(inst.transcribe(pcmf32) == expected);
+    }
+
+    {
+        // a changed source gets a new key and its stale conversion is removed
+        auto source = dir / "whisper-base.en-f16.bin";
+        std::filesystem::copy_file(Base_en_f16, source);
+        auto sourceCached = ac::whisper::Model::cachedWeightsPath(source.string().c_str(), params);
+        ac::whisper::Model(source.string().c_str(), params);
+        REQUIRE(std::filesystem::exists(sourceCached));
+
+        std::filesystem::last_write_time(source, std::filesystem::last_write_time(source) + std::chrono::hours(1));
+        auto updatedCached = ac::whisper::Model::cachedWeightsPath(source.string().c_str(), params);
+        CHECK(updatedCached != sourceCached);
+        ac::whisper::Model(source.string().c_str(), params);
+        CHECK(std::filesystem::exists(updatedCached));
+        CHECK_FALSE(std::filesystem::exists(sourceCached));
+
+        // the conversion of the other source in the same directory is kept
+        CHECK(std::filesystem::exists(cached));
+    }
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("stream") {
+    ac::whisper::Model model(Base_en_f16, {});
+    ac::whisper::Instance inst(model, {});
+
+    std::string audioFilePath = AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav";
+    auto pcmf32 = ac::audio::loadWavF32Mono(audioFilePath);
+    REQUIRE(pcmf32.size() > 0);
+
+    CHECK_THROWS(inst.pushAudio(pcmf32));
+
+    inst.beginStream({.stepMs = 1000, .lengthMs = 5000, .keepMs = 200});
+    CHECK(inst.streaming());
+
+    std::vector<ac::whisper::Instance::StreamSegment> finalSegments;
+    bool gotPartial = false;
+    auto collect = [&](std::vector<ac::whisper::Instance::StreamSegment> segments) {
+        for (auto& seg : segments) {
+            if (seg.final) {
+                finalSegments.push_back(std::move(seg));
+            }
+            else {
+                gotPartial = true;
+            }
+        }
+    };
+
+    const size_t chunk = 16000 / 4; // 250 ms
+    for (size_t i = 0; i < pcmf32.size(); i += chunk) {
+        auto size = std::min(chunk, pcmf32.size() - i);
+        inst.pushAudio(std::span(pcmf32).subspan(i, size));
+        collect(inst.poll());
+    }
+    collect(inst.finish());
+    CHECK_FALSE(inst.streaming());
+
+    CHECK(gotPartial);
+    REQUIRE(finalSegments.size() > 1);
+
+    std::string text;
+    int64_t prevT0 = -1;
+    for (auto& seg : finalSegments) {
+        CHECK(seg.t0 >= prevT0);
+        CHECK(seg.t1 >= seg.t0);
+        prevT0 = seg.t0;
+        text += seg.text;
+    }
+    CHECK(text.find("seminar") != std::string::npos);
+
+    {
+        // nothing is emitted twice, and the text is close to the transcript of the whole input
+        auto streamed = words(text);
+        auto full = words(ac::whisper::Instance(model, {}).transcribe(pcmf32));
+        CHECK(repeatedNgrams(streamed, 3) == 0);
+        CHECK(streamed.size() <= full.size() * 11 / 10);
+        CHECK(commonWords(streamed, full) >= full.size() * 8 / 10);
+    }
+
+    {
+        // continuous speech: the window is capped by finalizing the segments in it
+        std::vector<float> speech;
+        for (int i = 0; i < 3; ++i) {
+            speech.insert(speech.end(), pcmf32.begin(), pcmf32.end());
+        }
+
+        inst.beginStream({.stepMs = 1000, .lengthMs = 5000, .keepMs = 200});
+        finalSegments.clear();
+        for (size_t i = 0; i < speech.size(); i += chunk) {
+            auto size = std::min(chunk, speech.size() - i);
+            inst.pushAudio(std::span(speech).subspan(i, size));
+            collect(inst.poll());
+            CHECK(inst.streamWindowSize() <= 16000 * 5);
+        }
+        collect(inst.finish());
+        CHECK(finalSegments.size() > 3);
+    }
+
+    {
+        // the last push triggers a step, which leaves the end of the speech partial until finish
+        auto padded = pcmf32;
+        const size_t step = 16000;
+        padded.resize((padded.size() + step - 1) / step * step, 0.f);
+
+        inst.beginStream({.stepMs = 1000, .lengthMs = 5000, .keepMs = 200});
+        finalSegments.clear();
+        for (size_t i = 0; i < padded.size(); i += step) {
+            inst.pushAudio(std::span(padded).subspan(i, step));
+            collect(inst.poll());
+        }
+        auto last = inst.finish();
+        REQUIRE_FALSE(last.empty());
+        CHECK(std::all_of(last.begin(), last.end(), [](auto& seg) { return seg.final; }));
+        collect(std::move(last));
+
+        text.clear();
+        for (auto& seg : finalSegments) {
+            text += seg.text;
+        }
+        CHECK(text.find("January") != std::string::npos);
+    }
+}
+
+TEST_CASE("batch") {
+    ac::whisper::Model model(Base_en_f16, {});
+
+    auto prenticeHall = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/prentice-hall.wav");
+    auto asSheSat = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/as-she-sat.wav");
+    auto yes = ac::audio::loadWavF32Mono(AC_TEST_DATA_WHISPER_DIR "/yes.wav");
+
+    std::vector<std::span<const float>> inputs = {prenticeHall, asSheSat, yes, prenticeHall, {}};
+
+    ac::whisper::Batch batch(model, {}, {.maxBatchSize = 2, .nThreads = 4});
+    CHECK(batch.params().maxBatchSize == 2);
+
+    auto results = batch.transcribe(inputs);
+    REQUIRE(results.size() == inputs.size());
+
+    // same results as sequential inference with the same per-instance params
+    ac::whisper::Instance inst(model, {.nThreads = 2});
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        CHECK(results[i] == inst.transcribe(inputs[i]));
+    }
+    CHECK(results[0] == results[3]);
+    CHECK(results[4] == "");
+}